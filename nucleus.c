@@ -5,6 +5,7 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <termios.h>
 #include <ctype.h>
@@ -16,6 +17,13 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -23,6 +31,31 @@
 #define NUCLEUS_VERSION "0.0.1"
 #define NUCLEUS_TAB_STOP 8
 #define NUCLEUS_QUIT_TIMES 3
+#define NUCLEUS_HELP "HELP: CTRL + S = SAVE | CTRL + Q = QUIT | CTRL + B = BLOCK"
+// Row storage size classes go up in steps of 8 bytes to 256 bytes, then in
+// powers of two up to 4KB
+#define SLAB_SMALL_STEP 8
+#define SLAB_SMALL_MAX 256
+#define SLAB_NUM_CLASSES 36
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CHUNK_SIZE (256 * 1024)
+// Rows per block of the Fenwick trees
+#define FENWICK_BLOCK 64
+// How many lines ahead a reload looks for rows that are unchanged
+#define NUCLEUS_RELOAD_WINDOW 1024
+// Starting value of a 32-bit FNV-1a hash
+#define NUCLEUS_HASH_SEED 2166136261u
+// Files at least this big get a line index stored next to them, recording
+// where every NUCLEUS_INDEX_INTERVAL-th line starts
+#define NUCLEUS_INDEX_MIN_SIZE (8 * 1024 * 1024)
+#define NUCLEUS_INDEX_INTERVAL 1024
+#define NUCLEUS_INDEX_MAGIC "NUCIDX1"
+// How long to spend loading a file in the background between key checks
+#define NUCLEUS_LOAD_SLICE_MS 20
+// Bytes per row in hex view, and how much of a file is looked at to decide
+// whether it is binary
+#define NUCLEUS_HEX_WIDTH 16
+#define NUCLEUS_HEX_SNIFF_SIZE 8192
 
 // enum to define constants for the arrow keys, etc
 enum editorKey {
@@ -39,66 +72,388 @@ enum editorKey {
 };
 
 /*** data ***/
+// Structure to represent text that has been added
+/* struct fields:
+- char *b - string in buffer
+- int len - the length of the string in buffer
+*/
+typedef struct abuf {
+  char *b;
+  int len;
+} Abuf;
+
 // Structure to represent a row in the editor
 /* struct fields:
 - int size - integer length of string
-- char *chars - string of text to be put in this row
 - int rsize - size of contents of render
-- char *render - characters that should actually be displayed
+- int ccap, rcap - capacity of the blocks holding chars and render
+- unsigned int hash - hash of chars, used to find unchanged rows on reload
+- unsigned int gen - generation of the editor when the row last changed
+- char *chars - string of text to be put in this row
+- char *render - characters that should actually be displayed, or NULL when
+the row has no tabs and chars can be displayed as is
 */
 typedef struct erow {
   int size;
-  char *chars;
   int rsize;
+  int ccap;
+  int rcap;
+  unsigned int hash;
+  unsigned int gen;
+  char *chars;
   char *render;
 } Erow;
 
+// Structure to represent the allocator used for row storage
+/* struct fields:
+- void *freelist[] - one list of released blocks per size class
+- char *next - next unused byte in the current chunk
+- size_t left - number of unused bytes left in the current chunk
+- struct slabChunk *chunks - every chunk owned by the pool, so that the
+whole pool can be released at once
+*/
+typedef struct slabChunk {
+  struct slabChunk *next;
+} SlabChunk;
+
+typedef struct slabPool {
+  void *freelist[SLAB_NUM_CLASSES];
+  char *next;
+  size_t left;
+  SlabChunk *chunks;
+} SlabPool;
+
+// Structure to represent a file that is still being loaded. When a file has a
+// valid line index, the lines around the cursor are loaded first and the
+// rest while the editor waits for keys.
+/* struct fields:
+- char *map - contents of the file, mapped into memory; NULL once the whole
+file is loaded
+- size_t size - size of the file
+- uint64_t *offsets - byte offset of the first line of each chunk of
+NUCLEUS_INDEX_INTERVAL lines
+- int numchunks - number of chunks
+- char *loaded - whether each chunk has been loaded into rows
+- int numloaded - number of chunks loaded so far
+- int next - first chunk that may not be loaded yet
+*/
+typedef struct fileLoad {
+  char *map;
+  size_t size;
+  uint64_t *offsets;
+  int numchunks;
+  char *loaded;
+  int numloaded;
+  int next;
+} FileLoad;
+
+// Structure to represent the length of a row when the file was last read or
+// written
+/* struct fields:
+- int idx - index of the row
+- int bytes - its length then, with the newline
+*/
+typedef struct savedLen {
+  int idx;
+  int bytes;
+} SavedLen;
+
+// Structure to represent what changed since the file was last read or written,
+// so that saving only has to write that part
+/* struct fields:
+- unsigned int savedgen - generation of the editor at that time; rows with a
+later generation have changed since
+- int synced - whether the file held exactly the rows at that time, with a
+newline after each; otherwise the whole file has to be written
+- int editlo, edithi - first and last row changed since
+- int shiftlo - first row that may have moved in the file since, because rows
+were inserted or deleted before it; INT_MAX if none were. Rows that changed
+length are found when saving
+- SavedLen *lens - the length in bytes that each row changed since had at that
+time, in the order they first changed; only rows before shiftlo are listed
+- int numlens, lenscap - number of entries in lens, and room for them
+*/
+typedef struct saveState {
+  unsigned int savedgen;
+  int synced;
+  int editlo;
+  int edithi;
+  int shiftlo;
+  SavedLen *lens;
+  int numlens;
+  int lenscap;
+} SaveState;
+
+// Structure to represent a byte changed in hex view
+/* struct fields:
+- off_t off - offset of the byte in the file
+- unsigned char byte - its new value
+*/
+typedef struct hexPatch {
+  off_t off;
+  unsigned char byte;
+} HexPatch;
+
+// Structure to represent a file shown as hex. The file is only mapped, never
+// copied: rows are formatted from the mapping as they are drawn, and changed
+// bytes are kept aside until they are written back in place.
+/* struct fields:
+- unsigned char *map - contents of the file, mapped read-only; NULL when the
+buffer is not in hex view
+- size_t size - size of the file
+- HexPatch *patches - changed bytes, sorted by offset
+- int numpatches - number of changed bytes
+- int patchcap - number of changed bytes there is space for
+- int offwidth - number of hex digits used to show offsets
+- int ascii - whether keys type characters into the ASCII column rather than
+hex digits
+- int nibble - whether the low half of the byte under the cursor is typed next
+*/
+typedef struct hexView {
+  unsigned char *map;
+  size_t size;
+  HexPatch *patches;
+  int numpatches;
+  int patchcap;
+  int offwidth;
+  int ascii;
+  int nibble;
+} HexView;
+
+// Structure to represent a Fenwick tree, which keeps prefix sums of a few
+// values per row so that they can be updated and searched in O(log n). The
+// tree is over blocks of FENWICK_BLOCK rows, and only the values of the rows
+// are kept one by one, as ints. Block sums and nodes are only kept up to a
+// watermark; the rest are worked out when a query reaches them, so rows can
+// be inserted and deleted without rebuilding the whole tree.
+/* struct fields:
+- int *values - the values of each row, width per row; those past the last
+row are kept zero, so rows added at the end need no clearing
+- long long *blocks - the sum of each value over each block of rows
+- long long *tree - the nodes over the blocks, indexed from 1, with width
+values per node
+- long long *total - the sum of each value over all rows
+- int width - number of values per row
+- int n - number of rows
+- int cap - number of rows there is space for
+- int summed - blocks before this one have their sums worked out
+- int built - nodes up to here are built
+*/
+typedef struct fenwick {
+  int *values;
+  long long *blocks;
+  long long *tree;
+  long long *total;
+  int width;
+  int n;
+  int cap;
+  int summed;
+  int built;
+} Fenwick;
+
+// Columns of the document statistics
+enum statColumn {
+  STAT_BYTES = 0,
+  STAT_CHARS,
+  STAT_WORDS,
+  STAT_COLUMNS
+};
+
+// Columns of the wrap layout
+enum wrapColumn {
+  WRAP_LINES = 0,
+  WRAP_ESTIMATED,
+  WRAP_COLUMNS
+};
+
+// Structure to represent the screen lines of the rows at one width
+/* struct fields:
+- int width - width the rows are laid out for
+- Fenwick lines - for each row, the number of screen lines it takes, and 1 if
+that number is only estimated from its length so far
+*/
+typedef struct wrapLines {
+  int width;
+  Fenwick lines;
+} WrapLines;
+
+// Structure to represent the layout of the rows in wrap mode, where rows
+// longer than the window are broken at spaces over several screen lines
+/* struct fields:
+- int on - whether wrap mode is on
+- WrapLines *layouts, int numlayouts - the rows laid out at each width that
+a window has, so switching between windows of different widths keeps them
+- int cur - index of the layout for the active window; -1 if there is none
+*/
+typedef struct wrapLayout {
+  int on;
+  WrapLines *layouts;
+  int numlayouts;
+  int cur;
+} WrapLayout;
+
+// Structure to walk through the lines of a mapped file
+/* struct fields:
+- const char *buf - contents of the file
+- size_t len - length of the file
+- size_t off - offset of the next line
+*/
+typedef struct lineReader {
+  const char *buf;
+  size_t len;
+  size_t off;
+} LineReader;
+
+// Header of the line index stored next to a large file
+/* struct fields:
+- char magic[8] - identifies the file as a line index
+- uint64_t size, int64_t mtime_sec, mtime_nsec - size and modification time
+of the file when it was indexed
+- uint32_t checksum - checksum of samples of the file's contents
+- uint32_t interval - number of lines between recorded offsets
+- uint64_t numlines - number of lines in the file
+The header is followed by one uint64_t offset per chunk of interval lines.
+*/
+typedef struct lineIndexHeader {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint32_t checksum;
+  uint32_t interval;
+  uint64_t numlines;
+} LineIndexHeader;
+
+// Structure to represent a window onto the buffer. Every window shows the
+// same rows, but has its own cursor and scroll position.
+/* struct fields:
+- int top, left - screen row and column of the top left corner of the window
+- int rows, cols - size of the window, not counting its separators
+- int cx, cy, rx, rowoff, rowsub, coloff - cursor and scroll position of the
+window; while a window is active these live in the editor state instead
+- int drawn_rowoff, drawn_rowsub, drawn_coloff - scroll position of the window
+when it was last drawn
+- Abuf *drawn - each line of the window as it was last sent to the terminal,
+or NULL if nothing is known to be on the screen
+- int redraw - whether the whole window must be drawn again
+*/
+typedef struct window {
+  int top, left;
+  int rows, cols;
+  int cx, cy, rx;
+  int rowoff, rowsub, coloff;
+  int drawn_rowoff, drawn_rowsub, drawn_coloff;
+  Abuf *drawn;
+  int redraw;
+} Window;
+
 // Structure to represent the editor state
 /* struct fields:
 - struct termios orig_termios - termios object that represents the terminal
-- int screenRows - the number of rows on the screen
-- int screenCols - the number of columns on the screen
+- int termRows - the number of rows on the screen available for text
+- int termCols - the number of columns on the screen
+- int screenRows - the number of rows in the active window
+- int screenCols - the number of columns in the active window
+- Window *win, int numwins, int curwin - the windows on the screen and the
+index of the active one
+- int damage_lo, damage_hi - range of rows changed since the screen was last
+drawn; damage_lo > damage_hi when nothing changed
 - int cx, cy - the x & y coordinates of the cursor
 - int rx - index into the render field of an row, so cursor can be moved
 to the current position
 - int numrows - the number of rows to text
+- int rowcap - the number of rows there is space for in row
 - Erow *erow - an array of rows
 - int rowoff - the offset variable, which keeps track of the row
+- int rowsub - in wrap mode, the number of screen lines of row rowoff that are
+scrolled off the top
 - int coloff - the offset variable, keeps track of the column
 - char *filename - string storing filename
 - char statusmsg[100] - buffer for the status message string
 - time_t statusmsg_time - time since status message was updated
 - int dirty - number of changes that have been made
 the user is currently scrolled to
+- unsigned int gen - generation counter, advanced whenever a row changes
+- SlabPool pool - allocator for the text of the rows in this buffer
+- int block - whether a block selection is active
+- int block_cy, block_rx - the row and render column where the block
+selection was started; the block spans from there to the cursor and every
+row in it gets its own cursor
+- int block_curx - the render column of the cursor edge of the block, which
+is kept while the cursor passes rows too short to reach it
+- char **yank, size_t *yanklens, int numyank - lines copied by the last yank
+or line delete, ready to be put back
+- struct timespec mtime, off_t disksize - modification time and size of the
+file when it was last read or written, to notice changes by other programs
+- time_t lastcheck - last time the file was checked for changes
+- FileLoad load - state of a file that is still being loaded
+- Fenwick stats - byte, character and word counts of the rows, where bytes and
+characters count the newline
+- SaveState save - what changed since the file was last read or written
+- HexView hex - the file shown as hex, for binary files, in which case there
+are no rows, only NUCLEUS_HEX_WIDTH bytes per line
+- WrapLayout wrap - the screen lines of each row in wrap mode
 */
 typedef struct editorConfig {
   // Structure to represent the terminal
   struct termios orig_termios;
+  int termRows;
+  int termCols;
   int screenRows;
   int screenCols;
+  Window *win;
+  int numwins;
+  int curwin;
+  int damage_lo, damage_hi;
   int cx, cy;
   int rx;
   int numrows;
+  int rowcap;
   Erow *row;
   int rowoff;
+  int rowsub;
   int coloff;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   int dirty;
+  unsigned int gen;
+  SlabPool pool;
+  int block;
+  int block_cy, block_rx;
+  int block_curx;
+  char **yank;
+  size_t *yanklens;
+  int numyank;
+  struct timespec mtime;
+  off_t disksize;
+  time_t lastcheck;
+  FileLoad load;
+  Fenwick stats;
+  SaveState save;
+  HexView hex;
+  WrapLayout wrap;
 } Editor;
 
 Editor E;
 
-// Structure to represent text that has been added
+// Structure to represent the terminal the editor draws to. In daemon mode it
+// is a client attached over a socket, and lives longer than any one buffer.
 /* struct fields:
-- char *b - string in buffer
-- int len - the length of the string in buffer
+- int in, out - file descriptors to read keys from and to write output to
+- int remote - whether the terminal is a client attached to the daemon
+- int detached - set once the client has gone away or asked to detach
+- int listen - the socket the daemon accepts clients on, or -1
+- Abuf status, message - the status and message bars as last drawn
 */
-typedef struct abuf {
-  char *b;
-  int len;
-} Abuf;
+typedef struct tty {
+  int in, out;
+  int remote;
+  int detached;
+  int listen;
+  Abuf status, message;
+} Tty;
+
+Tty T = {STDIN_FILENO, STDOUT_FILENO, 0, 0, -1, ABUF_INIT, ABUF_INIT};
 
 /*** prototypes ***/
 
@@ -106,12 +461,23 @@ typedef struct abuf {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt);
+void editorSaveWindow();
+void editorLoadWindow(int i);
+void editorShiftWindows(int at, int delcount, int inscount);
+int editorLoadSome();
+void editorEnsureRows(int lo, int hi);
+void editorHexClose();
+void editorWrapUpdate(int idx);
+void editorWrapFree();
+int editorWrapSome();
+int editorCheckFileChanged();
+void daemonTurnAway();
 
 /*** terminal ***/
 void die(const char *s) {
   // Clear the screen when the program exits
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  write(T.out, "\x1b[2J", 4);
+  write(T.out, "\x1b[H", 3);
   // prints descriptive error message for the gloabl errno variable,
   // that is set when something fails
   perror(s);
@@ -174,13 +540,57 @@ void enableRawMode() {
 }
 
 /*
-Waits for one key press and returns it.
+Reads one byte of input, giving up after a tenth of a second like the raw
+mode terminal does. Returns the number of bytes read, or -1 on error.
+*/
+int editorReadByte(char *c) {
+  if (!T.remote) return read(T.in, c, 1);
+
+  // A socket has no read timeout of its own, so wait for input with poll.
+  // Other clients that connect meanwhile are turned away.
+  struct pollfd pfd[2] = {{T.in, POLLIN, 0}, {T.listen, POLLIN, 0}};
+  int ready = poll(pfd, 2, 100);
+  if (ready == -1) return errno == EINTR ? 0 : -1;
+  if (pfd[1].revents & POLLIN) daemonTurnAway();
+  if (!(pfd[0].revents & (POLLIN | POLLHUP))) return 0;
+  int nread = read(T.in, c, 1);
+  if (nread <= 0) {
+    // The client has gone away
+    T.detached = 1;
+    return 0;
+  }
+  return nread;
+}
+
+/*
+Returns whether there is input waiting to be read.
+*/
+int editorInputReady() {
+  struct pollfd pfd = {T.in, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+Waits for one key press and returns it. If the client detaches while waiting,
+returns escape so that any prompt is cancelled.
 */
 int editorReadKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  while (1) {
+    // Use the time waiting for a key to load the rest of the file
+    if (E.load.map && !editorInputReady()) {
+      editorLoadSome();
+      editorRefreshScreen();
+      continue;
+    }
+    // ... and to lay out the rows that wrap mode has only estimated
+    if (E.wrap.on && !editorInputReady() && editorWrapSome()) continue;
+    if ((nread = editorReadByte(&c)) == 1) break;
     if (nread == -1 && errno != EAGAIN) die("read");
+    if (T.detached) return '\x1b';
+    // Use the time waiting for a key to notice changes to the file on disk
+    if (editorCheckFileChanged()) editorRefreshScreen();
   }
 
   // Checks for start of an escape character
@@ -190,15 +600,15 @@ int editorReadKey() {
     /* Read the next two bytes into the seq buffer, and return the Escape key
     if either of these reads times out (assuming that the user pressed the
   Escape key). */
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadByte(&seq[0]) != 1) return '\x1b';
+    if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
     // Check for arrow key escape sequence
     if (seq[0] == '[') {
       if (seq[0] >= '0' && seq[1] <= '9') {
         // Attempt to read another byte and if there's nothing,
         // assume escape key
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadByte(&seq[2]) != 1) return '\x1b';
 
         // A tilde indicates one of the following keys
         // HOME_KEY and END_KEY are handled multiple times because there
@@ -256,6 +666,322 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+/*** row storage ***/
+
+/*
+Returns the size class that a block of n bytes falls into.
+*/
+int slabClass(size_t n) {
+  if (n <= SLAB_SMALL_MAX) {
+    return n == 0 ? 0 : (n + SLAB_SMALL_STEP - 1) / SLAB_SMALL_STEP - 1;
+  }
+  int cls = SLAB_SMALL_MAX / SLAB_SMALL_STEP;
+  size_t blocksize = SLAB_SMALL_MAX * 2;
+  while (blocksize < n) {
+    blocksize <<= 1;
+    cls++;
+  }
+  return cls;
+}
+
+/*
+Returns the size of the blocks in a given size class.
+*/
+size_t slabClassSize(int cls) {
+  int nsmall = SLAB_SMALL_MAX / SLAB_SMALL_STEP;
+  if (cls < nsmall) return (cls + 1) * SLAB_SMALL_STEP;
+  return (size_t)SLAB_SMALL_MAX << (cls - nsmall + 1);
+}
+
+/*
+Allocates a block of at least n bytes for row storage and stores its real
+capacity in cap. Small blocks are carved out of large chunks so that a row
+does not pay for a malloc header, and blocks that are too big for any size
+class go straight to malloc.
+*/
+char *slabAlloc(SlabPool *pool, int n, int *cap) {
+  if (n > SLAB_MAX_SIZE) {
+    // Leave some slack so that a long row does not move on every keystroke
+    *cap = n + n / 2;
+    char *p = malloc(*cap);
+    if (p == NULL) die("malloc");
+    return p;
+  }
+
+  int cls = slabClass(n);
+  size_t blocksize = slabClassSize(cls);
+  *cap = blocksize;
+
+  // Reuse a released block of the same class if there is one
+  if (pool->freelist[cls]) {
+    void *p = pool->freelist[cls];
+    pool->freelist[cls] = *(void **)p;
+    return p;
+  }
+
+  // Start a new chunk if the current one has run out
+  if (pool->left < blocksize) {
+    // The chunk header is padded to the smallest block size to keep blocks aligned
+    SlabChunk *chunk = malloc(SLAB_CHUNK_SIZE + SLAB_SMALL_STEP);
+    if (chunk == NULL) die("malloc");
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->next = (char *)chunk + SLAB_SMALL_STEP;
+    pool->left = SLAB_CHUNK_SIZE;
+  }
+
+  char *p = pool->next;
+  pool->next += blocksize;
+  pool->left -= blocksize;
+  return p;
+}
+
+/*
+Releases a block of capacity cap back to its size class.
+*/
+void slabFree(SlabPool *pool, char *p, int cap) {
+  if (p == NULL) return;
+  if (cap > SLAB_MAX_SIZE) {
+    free(p);
+    return;
+  }
+  int cls = slabClass(cap);
+  *(void **)p = pool->freelist[cls];
+  pool->freelist[cls] = p;
+}
+
+/*
+Grows a block so it can hold at least n bytes, keeping the first used bytes.
+Blocks are only moved when they outgrow their size class.
+*/
+char *slabRealloc(SlabPool *pool, char *p, int *cap, int used, int n) {
+  if (p != NULL && n <= *cap) return p;
+  int newcap;
+  char *new = slabAlloc(pool, n, &newcap);
+  if (p != NULL) {
+    memcpy(new, p, used);
+    slabFree(pool, p, *cap);
+  }
+  *cap = newcap;
+  return new;
+}
+
+/*
+Releases every chunk owned by the pool at once. Blocks that were too big for
+a size class are not tracked by the pool and must be freed by the caller first.
+*/
+void slabDestroy(SlabPool *pool) {
+  SlabChunk *chunk = pool->chunks;
+  while (chunk) {
+    SlabChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(pool, 0, sizeof(SlabPool));
+}
+
+/*** document statistics ***/
+
+/*
+Create a tree with width values per row.
+*/
+void fenwickInit(Fenwick *f, int width) {
+  memset(f, 0, sizeof(Fenwick));
+  f->width = width;
+  f->total = calloc(width, sizeof(long long));
+  if (f->total == NULL) die("calloc");
+}
+
+/*
+Returns the number of blocks that n rows take.
+*/
+int fenwickBlocks(int n) {
+  return (n + FENWICK_BLOCK - 1) / FENWICK_BLOCK;
+}
+
+/*
+Make space for n rows. The first allocation is zeroed lazily by the system,
+so creating a tree for many rows at once costs nothing until they are used.
+*/
+void fenwickReserve(Fenwick *f, int n) {
+  if (n <= f->cap) return;
+  int w = f->width;
+  int newcap = f->cap ? f->cap * 2 : 64;
+  while (newcap < n) newcap *= 2;
+  int nblocks = fenwickBlocks(newcap);
+  if (f->values == NULL) {
+    f->values = calloc((size_t)newcap * w, sizeof(int));
+    if (f->values == NULL) die("calloc");
+  } else {
+    f->values = realloc(f->values, sizeof(int) * w * newcap);
+    if (f->values == NULL) die("realloc");
+    memset(&f->values[(size_t)f->cap * w], 0, sizeof(int) * w * (newcap - f->cap));
+  }
+  f->blocks = realloc(f->blocks, sizeof(long long) * w * nblocks);
+  f->tree = realloc(f->tree, sizeof(long long) * w * (nblocks + 1));
+  if (f->blocks == NULL || f->tree == NULL) die("realloc");
+  f->cap = newcap;
+}
+
+/*
+Work out the block sums and build the nodes up to node i.
+*/
+void fenwickEnsure(Fenwick *f, int i) {
+  int w = f->width;
+  for (; f->summed < i; f->summed++) {
+    long long *block = &f->blocks[f->summed * w];
+    memset(block, 0, sizeof(long long) * w);
+    int end = (f->summed + 1) * FENWICK_BLOCK;
+    if (end > f->n) end = f->n;
+    for (int r = f->summed * FENWICK_BLOCK; r < end; r++) {
+      for (int k = 0; k < w; k++) {
+        block[k] += f->values[(size_t)r * w + k];
+      }
+    }
+  }
+  for (; f->built < i; f->built++) {
+    // A node is its own block plus the nodes of its children
+    int node = f->built + 1;
+    for (int k = 0; k < w; k++) {
+      long long sum = f->blocks[(node - 1) * w + k];
+      for (int step = 1; step < (node & -node); step *= 2) {
+        sum += f->tree[(node - step) * w + k];
+      }
+      f->tree[node * w + k] = sum;
+    }
+  }
+}
+
+/*
+Forget the block sums and nodes that depend on the rows from idx on.
+*/
+void fenwickInvalidate(Fenwick *f, int idx) {
+  int b = idx / FENWICK_BLOCK;
+  if (f->summed > b) f->summed = b;
+  if (f->built > b) f->built = b;
+}
+
+/*
+Make room for count rows of zeros at index idx.
+*/
+void fenwickInsert(Fenwick *f, int idx, int count) {
+  int w = f->width;
+  int oldblocks = fenwickBlocks(f->n);
+  fenwickReserve(f, f->n + count);
+  if (idx < f->n) {
+    memmove(&f->values[(size_t)(idx + count) * w], &f->values[(size_t)idx * w],
+      sizeof(int) * w * (f->n - idx));
+    memset(&f->values[(size_t)idx * w], 0, sizeof(int) * w * count);
+    fenwickInvalidate(f, idx);
+  }
+  f->n += count;
+  // Zeros added at the end leave every block sum as it was
+  if (idx == f->n - count && f->summed == oldblocks) {
+    int nblocks = fenwickBlocks(f->n);
+    memset(&f->blocks[oldblocks * w], 0, sizeof(long long) * w * (nblocks - oldblocks));
+    f->summed = nblocks;
+  }
+}
+
+/*
+Remove count rows at index idx.
+*/
+void fenwickDelete(Fenwick *f, int idx, int count) {
+  int w = f->width;
+  for (size_t i = (size_t)idx * w; i < (size_t)(idx + count) * w; i++) {
+    f->total[i % w] -= f->values[i];
+  }
+  memmove(&f->values[(size_t)idx * w], &f->values[(size_t)(idx + count) * w],
+    sizeof(int) * w * (f->n - idx - count));
+  memset(&f->values[(size_t)(f->n - count) * w], 0, sizeof(int) * w * count);
+  f->n -= count;
+  fenwickInvalidate(f, idx);
+}
+
+/*
+Returns the sum of column k over the first i rows.
+*/
+long long fenwickPrefix(Fenwick *f, int i, int k) {
+  if (i >= f->n) return f->total[k];
+  int b = i / FENWICK_BLOCK;
+  fenwickEnsure(f, b);
+  long long sum = 0;
+  for (int r = b * FENWICK_BLOCK; r < i; r++) {
+    sum += f->values[(size_t)r * f->width + k];
+  }
+  for (; b > 0; b -= b & -b) {
+    sum += f->tree[b * f->width + k];
+  }
+  return sum;
+}
+
+/*
+Returns column k of the row at index idx.
+*/
+long long fenwickGet(Fenwick *f, int idx, int k) {
+  return f->values[(size_t)idx * f->width + k];
+}
+
+/*
+Set the values of the row at index idx. Each value must fit in an int.
+*/
+void fenwickSet(Fenwick *f, int idx, const long long *values) {
+  int w = f->width;
+  int b = idx / FENWICK_BLOCK;
+  for (int k = 0; k < w; k++) {
+    long long delta = values[k] - f->values[(size_t)idx * w + k];
+    if (delta == 0) continue;
+    f->values[(size_t)idx * w + k] = values[k];
+    f->total[k] += delta;
+    // Sums that are not worked out yet will see the new value when they are
+    if (b < f->summed) f->blocks[b * w + k] += delta;
+    for (int i = b + 1; i <= f->built; i += i & -i) {
+      f->tree[i * w + k] += delta;
+    }
+  }
+}
+
+/*
+Returns the number of leading rows whose sum of column k does not exceed
+target. The values of the column must not be negative.
+*/
+int fenwickSearch(Fenwick *f, int k, long long target) {
+  int w = f->width;
+  int nblocks = fenwickBlocks(f->n);
+  fenwickEnsure(f, nblocks);
+  // Find the whole blocks first, then the rows in the next one
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= nblocks) step *= 2;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= nblocks && f->tree[(pos + step) * w + k] <= target) {
+      pos += step;
+      target -= f->tree[pos * w + k];
+    }
+  }
+  int r = pos * FENWICK_BLOCK;
+  if (r > f->n) r = f->n;
+  while (r < f->n && f->values[(size_t)r * w + k] <= target) {
+    target -= f->values[(size_t)r * w + k];
+    r++;
+  }
+  return r;
+}
+
+/*
+Release the rows of the tree, keeping its width.
+*/
+void fenwickFree(Fenwick *f) {
+  free(f->values);
+  free(f->blocks);
+  free(f->tree);
+  f->values = NULL;
+  f->blocks = NULL;
+  f->tree = NULL;
+  f->n = f->cap = f->summed = f->built = 0;
+  memset(f->total, 0, sizeof(long long) * f->width);
+}
+
 /*** row operations ***/
 
 int editorRowCxToRx(Erow *row, int cx) {
@@ -272,18 +998,133 @@ int editorRowCxToRx(Erow *row, int cx) {
   return rx;
 }
 
+/*
+Converts an index into render to an index into chars. Positions past the end
+of the row map to the end of the row.
+*/
+int editorRowRxToCx(Erow *row, int rx) {
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size; cx++) {
+    if (row->chars[cx] == '\t') {
+      cur_rx += (NUCLEUS_TAB_STOP - 1) - (cur_rx % NUCLEUS_TAB_STOP);
+    }
+    cur_rx++;
+    // Stop once the character covering rx has been passed
+    if (cur_rx > rx) return cx;
+  }
+  return cx;
+}
+
+/*
+Remember that the row at index idx has changed since the file was last read
+or written, and whether rows after it may have moved in the file.
+*/
+void editorMarkChanged(int idx, int moved) {
+  SaveState *sv = &E.save;
+  if (idx < sv->editlo) sv->editlo = idx;
+  if (idx > sv->edithi) sv->edithi = idx;
+  if (moved && idx < sv->shiftlo) sv->shiftlo = idx;
+}
+
+/*
+Remember the length the row at index idx had when the file was last read or
+written, if it is about to change for the first time since. Rows from shiftlo
+on are written whole anyway.
+*/
+void editorRememberLength(int idx) {
+  SaveState *sv = &E.save;
+  if (idx >= sv->shiftlo || E.row[idx].gen > sv->savedgen) return;
+  if (sv->numlens == sv->lenscap) {
+    sv->lenscap = sv->lenscap ? sv->lenscap * 2 : 64;
+    sv->lens = realloc(sv->lens, sizeof(SavedLen) * sv->lenscap);
+    if (sv->lens == NULL) die("realloc");
+  }
+  sv->lens[sv->numlens].idx = idx;
+  sv->lens[sv->numlens].bytes = fenwickGet(&E.stats, idx, STAT_BYTES);
+  sv->numlens++;
+}
+
+/*
+Remember that rows lo to hi have changed and must be drawn again.
+*/
+void editorMarkDamage(int lo, int hi) {
+  if (lo < E.damage_lo) E.damage_lo = lo;
+  if (hi > E.damage_hi) E.damage_hi = hi;
+}
+
+/*
+Continues a 32-bit FNV-1a hash over len more bytes. A new hash starts from
+NUCLEUS_HASH_SEED.
+*/
+unsigned int editorHashStep(unsigned int hash, const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+Hashes the text of a row.
+*/
+unsigned int editorHashLine(const char *s, size_t len) {
+  return editorHashStep(NUCLEUS_HASH_SEED, s, len);
+}
+
+/*
+Returns the characters that should be displayed for a row.
+*/
+char *editorRowRender(Erow *row) {
+  if (row->render) return row->render;
+  // Rows that are not loaded yet have no text at all
+  return row->chars ? row->chars : "";
+}
+
 void editorUpdateRow(Erow *row) {
   int i;
 
-  // Calculate number of tabs
+  // Calculate number of tabs, and the character and word counts of the row
   int tabs = 0;
+  int chars = 0, words = 0, inword = 0;
   for (i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') tabs++;
+    unsigned char c = row->chars[i];
+    if (c == '\t') tabs++;
+    // Bytes that continue a UTF-8 sequence do not start a new character
+    if ((c & 0xc0) != 0x80) chars++;
+    if (isspace(c)) {
+      inword = 0;
+    } else if (!inword) {
+      inword = 1;
+      words++;
+    }
+  }
+  row->hash = editorHashLine(row->chars, row->size);
+
+  // Whether the rows after it moved in the file is worked out when saving,
+  // so a row that changes length and back again leaves them in place
+  int at = row - E.row;
+  long long stats[STAT_COLUMNS] = {row->size + 1, chars + 1, words};
+  editorRememberLength(at);
+  fenwickSet(&E.stats, at, stats);
+  row->gen = ++E.gen;
+  editorMarkChanged(at, 0);
+
+  editorMarkDamage(at, at);
+
+  // Rows without tabs are displayed straight from chars
+  if (tabs == 0) {
+    slabFree(&E.pool, row->render, row->rcap);
+    row->render = NULL;
+    row->rcap = 0;
+    row->rsize = row->size;
+    editorWrapUpdate(at);
+    return;
   }
 
-  // Clear and allocate space for new render
-  free(row->render);
-  row->render = malloc(row->size + tabs*(NUCLEUS_TAB_STOP -1) + 1);
+  // Make sure render has space for the expanded row
+  row->render = slabRealloc(&E.pool, row->render, &row->rcap, 0,
+    row->size + tabs*(NUCLEUS_TAB_STOP -1) + 1);
 
   int idx = 0;
   for (i = 0; i < row->size; i++) {
@@ -304,61 +1145,131 @@ void editorUpdateRow(Erow *row) {
   /*After the for loop, idx contains the number of characters we copied into
   row->render, so we assign it to row->rsize. */
   row->rsize = idx;
+  editorWrapUpdate(at);
 }
 
 /*
-Adds a row of given text s to the editor, by allocating space for a new
-row and then copying the given string s to a new row at the end of the array
-of rows.
+Make sure the array of rows has space for at least n rows. The array grows
+geometrically so that adding rows one at a time does not copy it every time.
 */
-void editorInsertRow(int idx, char *s, size_t len) {
-  if (idx < 0 || idx > E.numrows) return;
+void editorReserveRows(int n) {
+  if (n <= E.rowcap) return;
+  int newcap = E.rowcap ? E.rowcap * 2 : 64;
+  while (newcap < n) newcap *= 2;
+  Erow *new = realloc(E.row, sizeof(Erow) * newcap);
+  if (new == NULL) die("realloc");
+  E.row = new;
+  E.rowcap = newcap;
+}
 
-  // Allocate space for a new row
-  E.row = realloc(E.row, sizeof(Erow)*(E.numrows + 1));
-  memmove(&E.row[idx+1], &E.row[idx], sizeof(Erow)*(E.numrows-idx));
+/*
+Adds count rows of given text before the row at index idx. The array of rows
+is resized and shifted once for the whole range.
+*/
+void editorInsertRows(int idx, char **lines, size_t *lens, int count) {
+  if (idx < 0 || idx > E.numrows || count <= 0) return;
 
-  // Add last row to arrow of rows
-  E.row[idx].size = len;
-  E.row[idx].chars = malloc(len+1);
-  // Put row contents in new row
-  memcpy(E.row[idx].chars, s, len);
-  E.row[idx].chars[len] = '\0';
-  E.row[idx].rsize = 0;
-  E.row[idx].render = NULL;
+  // Make space for the new rows
+  editorReserveRows(E.numrows + count);
+  // Every row from here on moves down
+  editorMarkDamage(idx, INT_MAX);
+  editorMarkChanged(idx, 1);
+  memmove(&E.row[idx + count], &E.row[idx], sizeof(Erow) * (E.numrows - idx));
+  fenwickInsert(&E.stats, idx, count);
+  for (int i = 0; i < E.wrap.numlayouts; i++) {
+    fenwickInsert(&E.wrap.layouts[i].lines, idx, count);
+  }
+  editorShiftWindows(idx, 0, count);
 
-  editorUpdateRow(&E.row[idx]);
+  for (int i = 0; i < count; i++) {
+    Erow *row = &E.row[idx + i];
+    size_t len = lens[i];
+    row->size = len;
+    row->chars = slabAlloc(&E.pool, len + 1, &row->ccap);
+    // Put row contents in new row
+    memcpy(row->chars, lines[i], len);
+    row->chars[len] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->rcap = 0;
+    editorUpdateRow(row);
+  }
 
   // Update number of rows in editor
-  E.numrows++;
+  E.numrows += count;
   // Indicate that changes have been made
   E.dirty++;
 }
 
+/*
+Adds a row of given text s to the editor before the row at index idx.
+*/
+void editorInsertRow(int idx, char *s, size_t len) {
+  editorInsertRows(idx, &s, &len, 1);
+}
+
 /*
 Free the memory occupied by a specific row.
 */
 void editorFreeRow(Erow *row) {
-  free(row->render);
-  free(row->chars);
+  slabFree(&E.pool, row->render, row->rcap);
+  slabFree(&E.pool, row->chars, row->ccap);
 }
 
 /*
-Delete row at a specific index
+Free every row in the buffer. Rows that fit a size class are released in bulk
+with their pool, so only oversized rows are freed one at a time.
 */
-void editorDelRow(int idx) {
-  // Check for valid row index
-  if (idx < 0 || idx >= E.numrows) return;
-  // Free row
-  editorFreeRow(&E.row[idx]);
-  // Overwrite row with rows that come after it
-  memmove(&E.row[idx], &E.row[idx+1], sizeof(Erow) * (E.numrows - idx - 1));
+void editorFreeRows() {
+  if (E.hex.map) editorHexClose();
+  for (int i = 0; i < E.numrows; i++) {
+    if (E.row[i].ccap > SLAB_MAX_SIZE) free(E.row[i].chars);
+    if (E.row[i].rcap > SLAB_MAX_SIZE) free(E.row[i].render);
+  }
+  slabDestroy(&E.pool);
+  fenwickFree(&E.stats);
+  editorWrapFree();
+  free(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  E.rowcap = 0;
+}
+
+/*
+Delete count rows starting at a specific index. The rows after them are
+shifted once for the whole range.
+*/
+void editorDelRows(int idx, int count) {
+  // Check for valid row range
+  if (idx < 0 || idx >= E.numrows || count <= 0) return;
+  if (count > E.numrows - idx) count = E.numrows - idx;
+  // Every row from here on moves up
+  editorMarkDamage(idx, INT_MAX);
+  editorMarkChanged(idx, 1);
+  // Free rows
+  for (int i = idx; i < idx + count; i++) {
+    editorFreeRow(&E.row[i]);
+  }
+  // Overwrite rows with rows that come after them
+  memmove(&E.row[idx], &E.row[idx + count], sizeof(Erow) * (E.numrows - idx - count));
+  fenwickDelete(&E.stats, idx, count);
+  for (int i = 0; i < E.wrap.numlayouts; i++) {
+    fenwickDelete(&E.wrap.layouts[i].lines, idx, count);
+  }
+  editorShiftWindows(idx, count, 0);
   // Update number of rows
-  E.numrows--;
+  E.numrows -= count;
   // Indicate change
   E.dirty++;
 }
 
+/*
+Delete row at a specific index
+*/
+void editorDelRow(int idx) {
+  editorDelRows(idx, 1);
+}
+
 /*
 Insert a character into a given row in the editor.
 */
@@ -368,8 +1279,8 @@ void editorRowInsertChar(Erow *row, int idx, int c) {
     idx = row->size;
   }
 
-  // Reallocate space for the new character (and a null terminator)
-  row->chars = realloc(row->chars, row->size + 2);
+  // Make sure there is space for the new character (and a null terminator)
+  row->chars = slabRealloc(&E.pool, row->chars, &row->ccap, row->size + 1, row->size + 2);
 
   // Move memory block containing old string over
   memmove(&row->chars[idx + 1], &row->chars[idx], row->size - idx + 1);
@@ -383,8 +1294,8 @@ void editorRowInsertChar(Erow *row, int idx, int c) {
 }
 
 void editorRowAppendString(Erow *row, char *s, size_t len) {
-  // Reallocate space for the row and the new string
-  row->chars = realloc(row->chars, row->size + len + 1);
+  // Make sure there is space for the row and the new string
+  row->chars = slabRealloc(&E.pool, row->chars, &row->ccap, row->size, row->size + len + 1);
   // Copy string to end of row
   memcpy(&row->chars[row->size], s, len);
   // Update length of row & null terminate row
@@ -410,6 +1321,26 @@ void editorRowDelChar(Erow *row, int idx) {
   E.dirty++;
 }
 
+/*
+Replace dellen characters at a given index of a row with the string s, and
+update the row only once for the whole edit.
+*/
+void editorRowSplice(Erow *row, int at, int dellen, const char *s, int inslen) {
+  if (at < 0 || at > row->size) at = row->size;
+  if (dellen > row->size - at) dellen = row->size - at;
+
+  // Make sure there is space for the new string (and a null terminator)
+  row->chars = slabRealloc(&E.pool, row->chars, &row->ccap, row->size + 1,
+    row->size - dellen + inslen + 1);
+  // Move the rest of the row (and the null terminator) to fit the new string
+  memmove(&row->chars[at + inslen], &row->chars[at + dellen], row->size - at - dellen + 1);
+  memcpy(&row->chars[at], s, inslen);
+  row->size += inslen - dellen;
+
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
 /*** editor operatios ***/
 
 // Insert a character into the position that the
@@ -468,8 +1399,258 @@ void editorDelChar() {
   }
 }
 
-/*** file i/o ***/
-// Convert rows in editor to a single string
+/*** block operations ***/
+
+/*
+Multiple cursors are the cursors of a zero-width block: one on each row it
+covers, all in the same render column. Cursors can't be placed at unrelated
+rows or columns, which keeps every edit a single splice per row.
+*/
+
+/*
+Get the rows and render columns covered by the block selection. The right
+column is exclusive, so a block with left == right is a column of cursors.
+Returns 0 if the block does not cover any row.
+*/
+int editorBlockBounds(int *top, int *bottom, int *left, int *right) {
+  int rx = E.block_curx;
+  *top = E.block_cy < E.cy ? E.block_cy : E.cy;
+  *bottom = E.block_cy < E.cy ? E.cy : E.block_cy;
+  *left = E.block_rx < rx ? E.block_rx : rx;
+  *right = E.block_rx < rx ? rx : E.block_rx;
+  // Rows past the end of the file have no cursor
+  if (*bottom >= E.numrows) *bottom = E.numrows - 1;
+  return *top <= *bottom;
+}
+
+/*
+End the block selection. Its highlight is only drawn over the rows, so the
+active window is drawn again to take it away.
+*/
+void editorEndBlock() {
+  if (E.block) E.win[E.curwin].redraw = 1;
+  E.block = 0;
+}
+
+/*
+Start a block selection at the cursor, or end the current one.
+*/
+void editorToggleBlock() {
+  if (E.wrap.on) {
+    editorSetStatusMessage("Block selection is not available in wrap mode");
+    return;
+  }
+  if (E.block) {
+    editorEndBlock();
+  } else {
+    E.block = 1;
+    E.block_cy = E.cy;
+    E.block_rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    E.block_curx = E.block_rx;
+  }
+}
+
+/*
+Collapse the block selection to a column of cursors at render column rx, on
+the same rows it covered before.
+*/
+void editorBlockCollapse(int rx) {
+  // The column is shared by every row, so it is kept as it is even where a
+  // tab or the end of the cursor row covers it
+  if (E.cy < E.numrows) E.cx = editorRowRxToCx(&E.row[E.cy], rx);
+  E.block_rx = rx;
+  E.block_curx = rx;
+}
+
+/*
+Keep the cursor edge of the block selection in step with the cursor, after
+a key that moved the cursor within its row.
+*/
+void editorBlockFollowCursor() {
+  E.block_curx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+}
+
+/*
+Type a character at every cursor of the block selection, replacing the
+selected text. Each row is edited and updated once per keystroke.
+*/
+void editorBlockInsertChar(int c) {
+  int top, bottom, left, right;
+  if (!editorBlockBounds(&top, &bottom, &left, &right)) return;
+
+  // Rows that end before the block are padded with spaces up to its left edge
+  char *s = malloc(left + 1);
+  for (int y = top; y <= bottom; y++) {
+    Erow *row = &E.row[y];
+    int pad = left - row->rsize;
+    if (pad < 0) pad = 0;
+    memset(s, ' ', pad);
+    s[pad] = c;
+
+    int cxl = editorRowRxToCx(row, left);
+    int cxr = editorRowRxToCx(row, right);
+    editorRowSplice(row, cxl, cxr - cxl, s, pad + 1);
+  }
+  free(s);
+
+  // Move every cursor past the new character
+  editorBlockCollapse(left + 1);
+}
+
+/*
+Delete at every cursor of the block selection. The selected text is deleted
+if there is any; otherwise the character before (for backspace) or under
+(for delete) each cursor is deleted.
+*/
+void editorBlockDelChar(int key) {
+  int top, bottom, left, right;
+  if (!editorBlockBounds(&top, &bottom, &left, &right)) return;
+
+  int newrx = left;
+  for (int y = top; y <= bottom; y++) {
+    Erow *row = &E.row[y];
+    int cxl = editorRowRxToCx(row, left);
+    int cxr = editorRowRxToCx(row, right);
+    if (left == right) {
+      // Nothing selected, so delete a single character at this cursor
+      if (key == DELETE_KEY) {
+        cxr = cxl + 1;
+      } else if (cxl > 0 && row->rsize >= left) {
+        cxl--;
+      } else {
+        continue;
+      }
+      if (cxl < 0 || cxr > row->size) continue;
+    }
+    if (cxr > cxl) editorRowSplice(row, cxl, cxr - cxl, "", 0);
+    if (y == E.cy) newrx = editorRowCxToRx(row, cxl);
+  }
+  editorBlockCollapse(newrx);
+}
+
+/*** line operations ***/
+
+/*
+Ask the user for a number of lines. Returns 0 if the prompt was cancelled or
+the answer was not a positive number.
+*/
+int editorPromptCount(char *prompt) {
+  char *answer = editorPrompt(prompt);
+  if (answer == NULL) return 0;
+  int count = atoi(answer);
+  free(answer);
+  if (count <= 0) {
+    editorSetStatusMessage("Not a line count");
+    return 0;
+  }
+  return count;
+}
+
+/*
+Copy count rows starting at the cursor into the yank buffer. Returns the
+number of rows copied.
+*/
+int editorYankRows(int count) {
+  if (count > E.numrows - E.cy) count = E.numrows - E.cy;
+  if (count <= 0) return 0;
+
+  for (int i = 0; i < E.numyank; i++) {
+    free(E.yank[i]);
+  }
+  E.yank = realloc(E.yank, sizeof(char *) * count);
+  E.yanklens = realloc(E.yanklens, sizeof(size_t) * count);
+  for (int i = 0; i < count; i++) {
+    Erow *row = &E.row[E.cy + i];
+    E.yank[i] = malloc(row->size);
+    memcpy(E.yank[i], row->chars, row->size);
+    E.yanklens[i] = row->size;
+  }
+  E.numyank = count;
+  return count;
+}
+
+/*
+Keep the cursor inside the buffer after rows have been removed.
+*/
+void editorClampCursor() {
+  // Hex view has no rows that could be removed
+  if (E.hex.map) return;
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
+}
+
+/*
+Delete count rows starting at the cursor, keeping them in the yank buffer.
+*/
+void editorKillRows(int count) {
+  count = editorYankRows(count);
+  if (count == 0) return;
+  editorDelRows(E.cy, count);
+  editorClampCursor();
+  editorSetStatusMessage("%d lines deleted", count);
+}
+
+/*
+Insert the lines in the yank buffer before the cursor row.
+*/
+void editorPutRows() {
+  if (E.numyank == 0) {
+    editorSetStatusMessage("Nothing to put");
+    return;
+  }
+  editorInsertRows(E.cy, E.yank, E.yanklens, E.numyank);
+  E.cx = 0;
+  editorSetStatusMessage("%d lines put", E.numyank);
+}
+
+/*
+Insert the contents of another file before the cursor row. The file is read
+completely first and then added to the buffer as one range of rows.
+*/
+void editorInsertFile(char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
+
+  int count = 0, cap = 0;
+  char **lines = NULL;
+  size_t *lens = NULL;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen - 1] == '\r')) {
+      linelen--;
+    }
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      lines = realloc(lines, sizeof(char *) * cap);
+      lens = realloc(lens, sizeof(size_t) * cap);
+    }
+    lines[count] = malloc(linelen);
+    memcpy(lines[count], line, linelen);
+    lens[count] = linelen;
+    count++;
+  }
+  free(line);
+  fclose(fp);
+
+  editorInsertRows(E.cy, lines, lens, count);
+  E.cx = 0;
+  editorSetStatusMessage("%d lines inserted from %s", count, filename);
+
+  for (int i = 0; i < count; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+  free(lens);
+}
+
+/*** file i/o ***/
+// Convert rows in editor to a single string
 char *editorRowsToString(int *buflen) {
   // Determine how long the string should be
   int totallen = 0;
@@ -493,74 +1674,1453 @@ char *editorRowsToString(int *buflen) {
   return buf;
 }
 
-void editorOpen(char *filename) {
-  // Stores copy of filename
-  free(E.filename);
-  E.filename = strdup(filename);
+/*
+Remember the modification time and size of the file as it is now, so later
+changes made by other programs can be noticed.
+*/
+void editorRecordFileState() {
+  struct stat st;
+  if (E.filename && stat(E.filename, &st) == 0) {
+    E.mtime = st.st_mtim;
+    E.disksize = st.st_size;
+  } else {
+    E.disksize = -1;
+  }
+}
 
-  // Open and read a given file
-  FILE *fp = fopen(filename, "r");
-  if (!fp) {
-    die("fopen");
+/*
+Check whether text read from a file is exactly the rows made from it with a
+newline after each: that it has no carriage returns and ends in a newline.
+Rows read from anything else come out different when they are written back.
+*/
+int editorTextExact(const char *buf, size_t len) {
+  return memchr(buf, '\r', len) == NULL && (len == 0 || buf[len - 1] == '\n');
+}
+
+/*
+Remember that the file now holds the rows as they are, so that the next save
+only writes what changes from here on. exact tells whether the file holds
+them exactly, as editorTextExact decides; otherwise the next save writes the
+whole file. Call after editorRecordFileState.
+*/
+void editorMarkSynced(int exact) {
+  SaveState *sv = &E.save;
+  sv->savedgen = E.gen;
+  sv->editlo = INT_MAX;
+  sv->edithi = -1;
+  sv->shiftlo = INT_MAX;
+  sv->numlens = 0;
+  sv->synced = E.filename && exact;
+}
+
+/*** hex view ***/
+
+/*
+Check whether a file looks binary: whether its first bytes hold a NUL.
+*/
+int editorIsBinary(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return 0;
+  char buf[NUCLEUS_HEX_SNIFF_SIZE];
+  ssize_t len = read(fd, buf, sizeof(buf));
+  close(fd);
+  return len > 0 && memchr(buf, '\0', len) != NULL;
+}
+
+/*
+Show a file as hex by mapping it. Nothing is read up front, so this takes the
+same time for any size of file. Returns 0 if the file could not be mapped,
+and -1 if it has more rows than the editor can count.
+*/
+int editorOpenHex(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return 0;
   }
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  // Keep reading the file until you reach the end of the file
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    /* Decrease the length of linelen while it is greater than zero and the
-       last character in the line is a newline character or a return character.
-    */
-    while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
+  // Rows are counted in an int, which holds a little under 32 GB of them.
+  // The file is not opened at all, so that saving can't overwrite it.
+  if ((st.st_size - 1) / NUCLEUS_HEX_WIDTH >= INT_MAX - 1) {
+    close(fd);
+    free(E.filename);
+    E.filename = NULL;
+    editorSetStatusMessage("%s is too large to show (%lld bytes)", filename, (long long)st.st_size);
+    return -1;
+  }
+  // The mapping is shared so that bytes written back show up in it
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  HexView *h = &E.hex;
+  memset(h, 0, sizeof(HexView));
+  h->map = map;
+  h->size = st.st_size;
+  h->offwidth = 8;
+  while (h->offwidth < 16 && ((uint64_t)(h->size - 1) >> (4 * h->offwidth)) != 0) {
+    h->offwidth++;
+  }
+  E.numrows = (h->size + NUCLEUS_HEX_WIDTH - 1) / NUCLEUS_HEX_WIDTH;
+  if (E.filename != filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+  }
+  E.dirty = 0;
+  editorRecordFileState();
+  return 1;
+}
+
+/*
+Stop showing the file as hex, dropping unsaved changes.
+*/
+void editorHexClose() {
+  munmap(E.hex.map, E.hex.size);
+  free(E.hex.patches);
+  memset(&E.hex, 0, sizeof(HexView));
+  E.numrows = 0;
+}
+
+/*
+Returns the index of the first changed byte at or after a given offset.
+*/
+int editorHexFindPatch(off_t off) {
+  int lo = 0, hi = E.hex.numpatches;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.hex.patches[mid].off < off) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+Returns the byte at a given offset, as changed.
+*/
+unsigned char editorHexByte(off_t off) {
+  int i = editorHexFindPatch(off);
+  if (i < E.hex.numpatches && E.hex.patches[i].off == off) return E.hex.patches[i].byte;
+  return E.hex.map[off];
+}
+
+/*
+Change the byte at a given offset. Changing it back to what the file holds
+drops the change.
+*/
+void editorHexSetByte(off_t off, unsigned char byte) {
+  HexView *h = &E.hex;
+  int i = editorHexFindPatch(off);
+  int found = i < h->numpatches && h->patches[i].off == off;
+  if (byte == h->map[off]) {
+    if (found) {
+      memmove(&h->patches[i], &h->patches[i + 1], sizeof(HexPatch) * (h->numpatches - i - 1));
+      h->numpatches--;
     }
-    editorInsertRow(E.numrows, line, linelen);
+  } else if (found) {
+    h->patches[i].byte = byte;
+  } else {
+    if (h->numpatches == h->patchcap) {
+      h->patchcap = h->patchcap ? h->patchcap * 2 : 64;
+      h->patches = realloc(h->patches, sizeof(HexPatch) * h->patchcap);
+      if (h->patches == NULL) die("realloc");
+    }
+    memmove(&h->patches[i + 1], &h->patches[i], sizeof(HexPatch) * (h->numpatches - i));
+    h->patches[i].off = off;
+    h->patches[i].byte = byte;
+    h->numpatches++;
   }
-  free(line);
-  fclose(fp);
+  E.dirty = h->numpatches;
+  editorMarkDamage(off / NUCLEUS_HEX_WIDTH, off / NUCLEUS_HEX_WIDTH);
+}
+
+/*
+Format one line of hex view into buf, which must hold at least 96 bytes: the
+offset, the bytes in hex, and the bytes as characters. Returns its length.
+*/
+int editorHexRenderRow(int filerow, char *buf) {
+  static const char digits[] = "0123456789abcdef";
+  HexView *h = &E.hex;
+  off_t start = (off_t)filerow * NUCLEUS_HEX_WIDTH;
+  int count = h->size - start < NUCLEUS_HEX_WIDTH ? h->size - start : NUCLEUS_HEX_WIDTH;
+  int len = sprintf(buf, "%0*llx  ", h->offwidth, (unsigned long long)start);
+  char *ascii = &buf[len + NUCLEUS_HEX_WIDTH * 3 + 2];
+  memset(&buf[len], ' ', ascii - &buf[len]);
+  *ascii++ = '|';
+
+  // Walk the changed bytes of the row alongside the mapping
+  int p = editorHexFindPatch(start);
+  for (int i = 0; i < count; i++) {
+    unsigned char c = h->map[start + i];
+    if (p < h->numpatches && h->patches[p].off == start + i) c = h->patches[p++].byte;
+    char *hex = &buf[len + i * 3 + (i >= NUCLEUS_HEX_WIDTH / 2)];
+    hex[0] = digits[c >> 4];
+    hex[1] = digits[c & 0xf];
+    ascii[i] = isprint(c) ? c : '.';
+  }
+  for (int i = count; i < NUCLEUS_HEX_WIDTH; i++) {
+    ascii[i] = ' ';
+  }
+  ascii[NUCLEUS_HEX_WIDTH] = '|';
+  return ascii + NUCLEUS_HEX_WIDTH + 1 - buf;
+}
+
+/*
+Returns the screen column of the cursor in hex view.
+*/
+int editorHexRx() {
+  int start = E.hex.offwidth + 2;
+  if (E.hex.ascii) return start + NUCLEUS_HEX_WIDTH * 3 + 3 + E.cx;
+  return start + E.cx * 3 + (E.cx >= NUCLEUS_HEX_WIDTH / 2) + E.hex.nibble;
+}
+
+/*
+Write the changed bytes back into the file, each run of neighbouring bytes
+with a single pwrite. The rest of the file is not touched.
+*/
+void editorHexSave() {
+  HexView *h = &E.hex;
+  int fd = open(E.filename, O_WRONLY);
+  if (fd == -1) {
+    editorSetStatusMessage("Failed to save. I/O ERROR: %s", strerror(errno));
+    return;
+  }
+  unsigned char run[256];
+  int i = 0, written = 0;
+  while (i < h->numpatches) {
+    off_t start = h->patches[i].off;
+    int len = 0;
+    while (i < h->numpatches && len < (int)sizeof(run) && h->patches[i].off == start + len) {
+      run[len++] = h->patches[i++].byte;
+    }
+    if (pwrite(fd, run, len, start) != len) {
+      close(fd);
+      editorSetStatusMessage("Failed to save. I/O ERROR: %s", strerror(errno));
+      return;
+    }
+    written += len;
+  }
+  close(fd);
+  // The mapping now shows the bytes that were written
+  h->numpatches = 0;
   E.dirty = 0;
+  editorRecordFileState();
+  editorSetStatusMessage("%d bytes written in place", written);
+}
+
+/*
+Ask for an offset, in decimal or as 0x followed by hex, and move there.
+*/
+void editorHexGoto() {
+  char *answer = editorPrompt("Go to offset: %s (ESC to cancel)");
+  if (answer == NULL) return;
+  long long off = strtoll(answer, NULL, 0);
+  free(answer);
+  if (off < 0) off = 0;
+  if ((size_t)off >= E.hex.size) off = E.hex.size - 1;
+  E.cy = off / NUCLEUS_HEX_WIDTH;
+  E.cx = off % NUCLEUS_HEX_WIDTH;
+  E.hex.nibble = 0;
+}
+
+/*
+Handle a key in hex view. Hex digits change the byte under the cursor a half
+at a time, or after Tab, characters are typed into the ASCII column. Returns
+0 for keys that work the same as for text, such as saving and quitting.
+*/
+int editorHexProcessKey(int c) {
+  HexView *h = &E.hex;
+  size_t pos = (size_t)E.cy * NUCLEUS_HEX_WIDTH + E.cx;
+  size_t page = (size_t)E.screenRows * NUCLEUS_HEX_WIDTH;
+  switch (c) {
+    case CTRL_KEY('q'):
+    case CTRL_KEY('s'):
+    case CTRL_KEY('w'):
+    case CTRL_KEY('l'):
+    case '\x1b':
+      return 0;
+
+    case CTRL_KEY('g'):
+      editorHexGoto();
+      return 1;
+
+    case '\t':
+      h->ascii = !h->ascii;
+      h->nibble = 0;
+      return 1;
+
+    case ARROW_LEFT:
+      if (pos > 0) pos--;
+      break;
+    case ARROW_RIGHT:
+      if (pos + 1 < h->size) pos++;
+      break;
+    case ARROW_UP:
+      if (pos >= NUCLEUS_HEX_WIDTH) pos -= NUCLEUS_HEX_WIDTH;
+      break;
+    case ARROW_DOWN:
+      if (pos + NUCLEUS_HEX_WIDTH < h->size) pos += NUCLEUS_HEX_WIDTH;
+      break;
+    case PAGE_UP:
+      pos = pos >= page ? pos - page : pos % NUCLEUS_HEX_WIDTH;
+      break;
+    case PAGE_DOWN:
+      while (page > 0 && pos + page >= h->size) page -= NUCLEUS_HEX_WIDTH;
+      pos += page;
+      break;
+    case HOME_KEY:
+      pos -= E.cx;
+      break;
+    case END_KEY:
+      pos += NUCLEUS_HEX_WIDTH - 1 - E.cx;
+      if (pos >= h->size) pos = h->size - 1;
+      break;
+
+    default:
+      if (h->ascii) {
+        if (iscntrl(c) || c >= 128) return 1;
+        editorHexSetByte(pos, c);
+      } else {
+        if (c >= 128 || !isxdigit(c)) return 1;
+        int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        unsigned char byte = editorHexByte(pos);
+        if (!h->nibble) {
+          editorHexSetByte(pos, (v << 4) | (byte & 0x0f));
+          h->nibble = 1;
+          return 1;
+        }
+        editorHexSetByte(pos, (byte & 0xf0) | v);
+      }
+      if (pos + 1 < h->size) pos++;
+      break;
+  }
+  h->nibble = 0;
+  E.cy = pos / NUCLEUS_HEX_WIDTH;
+  E.cx = pos % NUCLEUS_HEX_WIDTH;
+  return 1;
+}
+
+/*** line index ***/
+
+/*
+Read the line at a given offset the same way editorOpen does, without the
+trailing newline and return characters. Returns the offset of the next line,
+or -1 if there are no more lines.
+*/
+ssize_t lineReaderPeek(LineReader *lr, size_t off, const char **line, size_t *len) {
+  if (off >= lr->len) return -1;
+  const char *start = lr->buf + off;
+  const char *nl = memchr(start, '\n', lr->len - off);
+  size_t linelen = nl ? (size_t)(nl - start) : lr->len - off;
+  size_t next = off + linelen + (nl ? 1 : 0);
+  while (linelen > 0 && start[linelen - 1] == '\r') linelen--;
+  *line = start;
+  *len = linelen;
+  return next;
+}
+
+/*
+Returns the path of the line index for a file: a hidden file next to it.
+*/
+char *editorIndexPath(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 16);
+  sprintf(path, "%.*s.%s.nucidx", dirlen, filename, filename + dirlen);
+  return path;
+}
+
+/*
+Checksum samples spread over the contents of a file, so that an index can be
+checked against the file without reading all of it.
+*/
+uint32_t editorIndexChecksum(const char *map, size_t size) {
+  const size_t nsamples = 64, samplesize = 4096;
+  uint32_t hash = NUCLEUS_HASH_SEED;
+  for (size_t i = 0; i < nsamples; i++) {
+    size_t off = size > samplesize ? (size - samplesize) / (nsamples - 1) * i : 0;
+    size_t len = size - off < samplesize ? size - off : samplesize;
+    hash = editorHashStep(hash, &map[off], len);
+  }
+  return hash;
+}
+
+/*
+Store the line index of a file that has just been read. Failing to write the
+index is not an error; the file is simply scanned again next time.
+*/
+void editorWriteIndex(const char *filename, uint64_t *offsets, uint64_t numlines) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return;
+  struct stat st;
+  char *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) return;
+
+  LineIndexHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, NUCLEUS_INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.size = st.st_size;
+  hdr.mtime_sec = st.st_mtim.tv_sec;
+  hdr.mtime_nsec = st.st_mtim.tv_nsec;
+  hdr.checksum = editorIndexChecksum(map, st.st_size);
+  hdr.interval = NUCLEUS_INDEX_INTERVAL;
+  hdr.numlines = numlines;
+  munmap(map, st.st_size);
+
+  // Write to a temporary file first so a half written index is never used
+  char *path = editorIndexPath(filename);
+  char *tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  size_t numoffsets = (numlines + NUCLEUS_INDEX_INTERVAL - 1) / NUCLEUS_INDEX_INTERVAL;
+  FILE *fp = fopen(tmp, "w");
+  if (fp) {
+    int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+      fwrite(offsets, sizeof(uint64_t), numoffsets, fp) == numoffsets;
+    if (fclose(fp) == 0 && ok) {
+      rename(tmp, path);
+    } else {
+      unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(path);
+}
+
+/*
+Load one chunk of lines from the mapped file into its rows.
+*/
+void editorLoadChunk(int k) {
+  FileLoad *ld = &E.load;
+  if (ld->loaded[k]) return;
+
+  LineReader lr = {ld->map, ld->size, ld->offsets[k]};
+  int first = k * NUCLEUS_INDEX_INTERVAL;
+  int last = first + NUCLEUS_INDEX_INTERVAL;
+  if (last > E.numrows) last = E.numrows;
+  // Rows loaded from the file have not changed since it was read, so there
+  // is no length of theirs to remember either
+  SaveState save = E.save;
+  unsigned int gen = E.gen;
+  E.save.shiftlo = 0;
+  size_t end = k + 1 < ld->numchunks ? ld->offsets[k + 1] : ld->size;
+  size_t bytes = 0;
+  for (int i = first; i < last; i++) {
+    const char *line;
+    size_t len;
+    ssize_t next = lineReaderPeek(&lr, lr.off, &line, &len);
+    // The index promised more lines than there are; leave the rest empty
+    if (next == -1) line = "", len = 0;
+    else lr.off = next;
+
+    Erow *row = &E.row[i];
+    row->size = len;
+    row->chars = slabAlloc(&E.pool, len + 1, &row->ccap);
+    memcpy(row->chars, line, len);
+    row->chars[len] = '\0';
+    editorUpdateRow(row);
+    row->gen = save.savedgen;
+    bytes += len + 1;
+  }
+  E.save = save;
+  E.gen = gen;
+  if (bytes != end - ld->offsets[k] ||
+      !editorTextExact(ld->map + ld->offsets[k], end - ld->offsets[k])) {
+    E.save.synced = 0;
+  }
+  ld->loaded[k] = 1;
+  ld->numloaded++;
+}
+
+/*
+Release the mapped file once every chunk has been loaded.
+*/
+void editorFinishLoad() {
+  FileLoad *ld = &E.load;
+  munmap(ld->map, ld->size);
+  free(ld->offsets);
+  free(ld->loaded);
+  memset(ld, 0, sizeof(FileLoad));
+}
+
+/*
+Make sure rows lo to hi are loaded.
+*/
+void editorEnsureRows(int lo, int hi) {
+  if (E.load.map == NULL) return;
+  if (lo < 0) lo = 0;
+  if (hi >= E.numrows) hi = E.numrows - 1;
+  if (lo > hi) return;
+  for (int k = lo / NUCLEUS_INDEX_INTERVAL; k <= hi / NUCLEUS_INDEX_INTERVAL; k++) {
+    editorLoadChunk(k);
+  }
+  if (E.load.numloaded == E.load.numchunks) editorFinishLoad();
+}
+
+/*
+Load chunks in file order for a short while. Returns 1 if there is more left
+to load.
+*/
+int editorLoadSome() {
+  FileLoad *ld = &E.load;
+  if (ld->map == NULL) return 0;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (ld->next < ld->numchunks) {
+    editorLoadChunk(ld->next++);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    if (ms >= NUCLEUS_LOAD_SLICE_MS) break;
+  }
+  if (ld->numloaded == ld->numchunks) {
+    editorFinishLoad();
+    return 0;
+  }
+  return 1;
+}
+
+/*
+Load whatever is left of the file.
+*/
+void editorLoadAll() {
+  if (E.load.map == NULL) return;
+  editorEnsureRows(0, E.numrows - 1);
+}
+
+/*
+Open a file using its line index, if it has a valid one. Every row is created
+empty and only the first chunk is loaded; the rest is loaded on demand or in
+the background. Returns 0 if there is no usable index.
+*/
+int editorOpenIndexed(const char *filename) {
+  char *path = editorIndexPath(filename);
+  FILE *fp = fopen(path, "r");
+  free(path);
+  if (!fp) return 0;
+
+  LineIndexHeader hdr;
+  int fd = -1;
+  char *map = MAP_FAILED;
+  uint64_t *offsets = NULL;
+  struct stat st;
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, NUCLEUS_INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.interval != NUCLEUS_INDEX_INTERVAL || hdr.numlines == 0 || hdr.numlines > INT_MAX) {
+    goto fail;
+  }
+  fd = open(filename, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1 || (uint64_t)st.st_size != hdr.size ||
+      st.st_mtim.tv_sec != hdr.mtime_sec || st.st_mtim.tv_nsec != hdr.mtime_nsec) {
+    goto fail;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED || editorIndexChecksum(map, st.st_size) != hdr.checksum) goto fail;
+
+  int numchunks = (hdr.numlines + NUCLEUS_INDEX_INTERVAL - 1) / NUCLEUS_INDEX_INTERVAL;
+  offsets = malloc(sizeof(uint64_t) * numchunks);
+  if (fread(offsets, sizeof(uint64_t), numchunks, fp) != (size_t)numchunks) goto fail;
+  for (int k = 0; k < numchunks; k++) {
+    if (offsets[k] >= hdr.size) goto fail;
+  }
+  fclose(fp);
+  close(fd);
+
+  // Create every row empty, to be filled in chunk by chunk. A fresh array is
+  // zeroed lazily by the system, which matters for files with many lines.
+  if (E.row == NULL) {
+    E.row = calloc(hdr.numlines, sizeof(Erow));
+    if (E.row == NULL) die("calloc");
+    E.rowcap = hdr.numlines;
+  } else {
+    editorReserveRows(hdr.numlines);
+    memset(E.row, 0, sizeof(Erow) * hdr.numlines);
+  }
+  E.numrows = hdr.numlines;
+  // Until a chunk is loaded, its first row stands in for the bytes of all of
+  // them, so byte offsets are right to the chunk from the start. A row holds
+  // at most an int, so a chunk bigger than that spills into the next rows.
+  fenwickInsert(&E.stats, 0, hdr.numlines);
+  for (int k = 0; k < numchunks; k++) {
+    uint64_t end = k + 1 < numchunks ? offsets[k + 1] : (uint64_t)st.st_size;
+    uint64_t bytes = end - offsets[k];
+    for (int i = k * NUCLEUS_INDEX_INTERVAL; bytes > 0 && i < (int)hdr.numlines; i++) {
+      long long stats[STAT_COLUMNS] = {bytes < INT_MAX ? bytes : INT_MAX, 0, 0};
+      fenwickSet(&E.stats, i, stats);
+      bytes -= stats[STAT_BYTES];
+    }
+  }
+  E.load.map = map;
+  E.load.size = st.st_size;
+  E.load.offsets = offsets;
+  E.load.numchunks = numchunks;
+  E.load.loaded = calloc(numchunks, 1);
+  E.load.numloaded = 0;
+  E.load.next = 0;
+  editorEnsureRows(0, 0);
+  return 1;
+
+fail:
+  free(offsets);
+  if (map != MAP_FAILED) munmap(map, st.st_size);
+  if (fd != -1) close(fd);
+  fclose(fp);
+  return 0;
+}
+
+/*
+Store the line index of a file that has just been written from the rows.
+*/
+void editorIndexRows() {
+  int numoffsets = (E.numrows + NUCLEUS_INDEX_INTERVAL - 1) / NUCLEUS_INDEX_INTERVAL;
+  uint64_t *offsets = malloc(sizeof(uint64_t) * (numoffsets ? numoffsets : 1));
+  for (int k = 0; k < numoffsets; k++) {
+    offsets[k] = fenwickPrefix(&E.stats, k * NUCLEUS_INDEX_INTERVAL, STAT_BYTES);
+  }
+  if (E.numrows > 0) editorWriteIndex(E.filename, offsets, E.numrows);
+  free(offsets);
+}
+
+void editorOpen(char *filename) {
+  // Stores copy of filename
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  // Binary files are shown as hex, straight from the file
+  if (editorIsBinary(filename) && editorOpenHex(filename)) return;
+
+  // Large files with a valid index do not need to be scanned
+  struct stat st;
+  int large = stat(filename, &st) == 0 && st.st_size >= NUCLEUS_INDEX_MIN_SIZE;
+  if (large && editorOpenIndexed(filename)) {
+    E.dirty = 0;
+    editorRecordFileState();
+    // Each chunk is checked as it is loaded
+    editorMarkSynced(1);
+    return;
+  }
+
+  // Open and read a given file
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    die("fopen");
+  }
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  // Remember where every NUCLEUS_INDEX_INTERVAL-th line starts, to index large files
+  uint64_t *offsets = NULL;
+  size_t numoffsets = 0, offsetcap = 0;
+  uint64_t offset = 0, numlines = 0;
+  int exact = 1;
+  // Keep reading the file until you reach the end of the file
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    if (!editorTextExact(line, linelen)) exact = 0;
+    if (large && numlines % NUCLEUS_INDEX_INTERVAL == 0) {
+      if (numoffsets == offsetcap) {
+        offsetcap = offsetcap ? offsetcap * 2 : 1024;
+        offsets = realloc(offsets, sizeof(uint64_t) * offsetcap);
+      }
+      offsets[numoffsets++] = offset;
+    }
+    offset += linelen;
+    numlines++;
+
+    /* Decrease the length of linelen while it is greater than zero and the
+       last character in the line is a newline character or a return character.
+    */
+    while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen - 1] == '\r')) {
+      linelen--;
+    }
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+  editorRecordFileState();
+  editorMarkSynced(exact);
+
+  if (large && numlines > 0) editorWriteIndex(filename, offsets, numlines);
+  free(offsets);
+}
+
+/*
+Write rows lo to hi - 1 into the file where they belong, a piece at a time.
+Adds the number of bytes written to written. Returns 0 on failure.
+*/
+int editorWriteRows(int fd, int lo, int hi, long long *written) {
+  off_t off = fenwickPrefix(&E.stats, lo, STAT_BYTES);
+  size_t cap = 64 * 1024, len = 0;
+  char *buf = malloc(cap);
+  int ok = 1;
+  for (int i = lo; i < hi && ok; i++) {
+    Erow *row = &E.row[i];
+    if (len + row->size + 1 > cap) {
+      // Send what is buffered, and make room for rows longer than the buffer
+      ok = pwrite(fd, buf, len, off) == (ssize_t)len;
+      off += len;
+      *written += len;
+      len = 0;
+      if ((size_t)row->size + 1 > cap) {
+        cap = row->size + 1;
+        buf = realloc(buf, cap);
+      }
+    }
+    memcpy(&buf[len], row->chars, row->size);
+    buf[len + row->size] = '\n';
+    len += row->size + 1;
+  }
+  if (ok && len > 0) {
+    ok = pwrite(fd, buf, len, off) == (ssize_t)len;
+    *written += len;
+  }
+  free(buf);
+  return ok;
+}
+
+/*
+Save by writing only what changed since the file was last read or written:
+the rows that changed, if no row moved, or else everything from the first
+change on. Returns 0 if the whole file has to be written instead.
+*/
+int editorSaveChanges() {
+  SaveState *sv = &E.save;
+  if (!sv->synced) return 0;
+  // Another program may have written the file since
+  struct stat st;
+  if (stat(E.filename, &st) == -1 || st.st_size != E.disksize ||
+      st.st_mtim.tv_sec != E.mtime.tv_sec || st.st_mtim.tv_nsec != E.mtime.tv_nsec) {
+    return 0;
+  }
+  int fd = open(E.filename, O_WRONLY);
+  if (fd == -1) return 0;
+
+  // The rows after the first one that is not the length it was have moved
+  for (int i = 0; i < sv->numlens; i++) {
+    SavedLen *len = &sv->lens[i];
+    if (len->idx < sv->shiftlo && fenwickGet(&E.stats, len->idx, STAT_BYTES) != len->bytes) {
+      sv->shiftlo = len->idx;
+    }
+  }
+
+  long long written = 0;
+  long long total = fenwickPrefix(&E.stats, E.numrows, STAT_BYTES);
+  int ok = 1;
+  if (sv->shiftlo == INT_MAX) {
+    // Every row is where it was, so write each run of changed rows over
+    // the old one
+    int i = sv->editlo;
+    while (ok && i <= sv->edithi && i < E.numrows) {
+      if (E.row[i].gen <= sv->savedgen) {
+        i++;
+        continue;
+      }
+      int end = i + 1;
+      while (end <= sv->edithi && end < E.numrows && E.row[end].gen > sv->savedgen) end++;
+      ok = editorWriteRows(fd, i, end, &written);
+      i = end;
+    }
+  } else {
+    int lo = sv->editlo < sv->shiftlo ? sv->editlo : sv->shiftlo;
+    ok = editorWriteRows(fd, lo, E.numrows, &written) && ftruncate(fd, total) != -1;
+  }
+  close(fd);
+  if (!ok) {
+    editorSetStatusMessage("Failed to save. I/O ERROR: %s", strerror(errno));
+    return 1;
+  }
+
+  E.dirty = 0;
+  editorRecordFileState();
+  editorMarkSynced(1);
+  // Even if no line moved, the index has to match the file's new time
+  if (total >= NUCLEUS_INDEX_MIN_SIZE) editorIndexRows();
+  editorSetStatusMessage("%lld bytes written to disk in place", written);
+  return 1;
+}
+
+/*
+Save contents of editor to file
+*/
+void editorSave() {
+  if (E.hex.map) {
+    editorHexSave();
+    return;
+  }
+
+  if (E.filename && editorSaveChanges()) return;
+
+  // Prompt for filename
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)");
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  };
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  /* Open file so it is available to read and write. If there is not an existing
+     file one will be created. 0644 is the estandard permission code for text files.
+     This code allows owner to read and write and others to only read the file.
+  */
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  // If successfully opened file, then write to file
+  if (fd != -1) {
+    // Prevents owner from overwriting other data.
+    // ftruncate sets the file's size to specified length
+    if (ftruncate(fd, len) != -1) {
+      // Write to file, check that the correct number of bytes was written
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        free(buf);
+        E.dirty = 0;
+        editorRecordFileState();
+        editorMarkSynced(1);
+        if (len >= NUCLEUS_INDEX_MIN_SIZE) editorIndexRows();
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return;
+      }
+    }
+    close(fd);
+  }
+  // Show error message
+  free(buf);
+  editorSetStatusMessage("Failed to save. I/O ERROR: %s", strerror(errno));
+}
+
+/*** external changes ***/
+
+/*
+Check whether a row holds exactly the given text.
+*/
+int editorRowEquals(Erow *row, const char *line, size_t len, unsigned int hash) {
+  return (size_t)row->size == len && row->hash == hash && memcmp(row->chars, line, len) == 0;
+}
+
+/*
+Replace delcount rows at index at with the given lines, and keep the cursor
+and the view on the same text.
+*/
+void editorReplaceRows(int at, int delcount, char **lines, size_t *lens, int inscount) {
+  editorDelRows(at, delcount);
+  editorInsertRows(at, lines, lens, inscount);
+
+  // The other windows have been moved along with the rows. The cursor of
+  // the active one moves too: rows after the replaced ones move by the
+  // difference, and rows inside them stay put unless the replacement is
+  // shorter.
+  if (E.cy >= at + delcount) {
+    E.cy += inscount - delcount;
+  } else if (E.cy > at + inscount) {
+    E.cy = at + inscount;
+  }
+  if (E.rowoff >= at + delcount) {
+    E.rowoff += inscount - delcount;
+  } else if (E.rowoff > at + inscount) {
+    E.rowoff = at + inscount;
+  }
+}
+
+/*
+Bring the buffer up to date with the file on disk, replacing only the rows
+that changed. Runs of equal rows are compared directly; where the file and
+the buffer differ, the next few lines of the file are hashed and matched
+against the row hashes to find where they agree again. Returns the number of
+rows that were replaced, and sets exact as editorTextExact decides for the
+whole file.
+*/
+int editorReloadFile(int *exact) {
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return -1;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  char *map = NULL;
+  if (st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  *exact = map ? editorTextExact(map, st.st_size) : 1;
+
+  LineReader lr = {map, st.st_size, 0};
+  char *winlines[NUCLEUS_RELOAD_WINDOW];
+  size_t winlens[NUCLEUS_RELOAD_WINDOW];
+  unsigned int winhashes[NUCLEUS_RELOAD_WINDOW];
+  size_t winnext[NUCLEUS_RELOAD_WINDOW];
+  int replaced = 0;
+  int i = 0;
+
+  while (1) {
+    const char *line;
+    size_t len;
+    ssize_t next;
+
+    // Skip over rows that did not change
+    while (i < E.numrows && (next = lineReaderPeek(&lr, lr.off, &line, &len)) != -1 &&
+        (size_t)E.row[i].size == len && memcmp(E.row[i].chars, line, len) == 0) {
+      lr.off = next;
+      i++;
+    }
+
+    // Hash the next lines of the file
+    int nwin = 0;
+    size_t off = lr.off;
+    while (nwin < NUCLEUS_RELOAD_WINDOW && (next = lineReaderPeek(&lr, off, &line, &len)) != -1) {
+      winlines[nwin] = (char *)line;
+      winlens[nwin] = len;
+      winhashes[nwin] = editorHashLine(line, len);
+      winnext[nwin] = next;
+      off = next;
+      nwin++;
+    }
+    if (i == E.numrows && nwin == 0) break;
+
+    // Find the smallest number of rows (a) and lines (b) to skip before the
+    // buffer and the file agree again
+    int found = 0, a = 0, b = 0;
+    for (int dist = 1; dist < 2 * NUCLEUS_RELOAD_WINDOW && !found; dist++) {
+      for (a = 0; a <= dist; a++) {
+        b = dist - a;
+        if (b >= nwin || i + a >= E.numrows) continue;
+        if (editorRowEquals(&E.row[i + a], winlines[b], winlens[b], winhashes[b])) {
+          found = 1;
+          break;
+        }
+      }
+    }
+
+    if (found) {
+      editorReplaceRows(i, a, winlines, winlens, b);
+      if (b > 0) lr.off = winnext[b - 1];
+      replaced += a > b ? a : b;
+      i += b;
+      continue;
+    }
+
+    // No common line nearby, so replace the rest of the buffer with the rest
+    // of the file
+    int count = 0, cap = NUCLEUS_RELOAD_WINDOW;
+    char **lines = malloc(sizeof(char *) * cap);
+    size_t *lens = malloc(sizeof(size_t) * cap);
+    off = lr.off;
+    while ((next = lineReaderPeek(&lr, off, &line, &len)) != -1) {
+      if (count == cap) {
+        cap *= 2;
+        lines = realloc(lines, sizeof(char *) * cap);
+        lens = realloc(lens, sizeof(size_t) * cap);
+      }
+      lines[count] = (char *)line;
+      lens[count] = len;
+      count++;
+      off = next;
+    }
+    int delcount = E.numrows - i;
+    editorReplaceRows(i, delcount, lines, lens, count);
+    replaced += delcount > count ? delcount : count;
+    free(lines);
+    free(lens);
+    break;
+  }
+
+  if (map) munmap(map, st.st_size);
+  editorClampCursor();
+  if (E.rowoff > E.numrows) E.rowoff = E.numrows;
+  E.dirty = 0;
+  return replaced;
+}
+
+/*
+Check, at most once a second, whether another program has changed the file.
+If the buffer has no unsaved changes it is reloaded, otherwise the user is
+warned. Returns 1 if the screen needs to be redrawn.
+*/
+int editorCheckFileChanged() {
+  if (E.filename == NULL || E.disksize == -1 || E.load.map || E.hex.map) return 0;
+  time_t now = time(NULL);
+  if (now == E.lastcheck) return 0;
+  E.lastcheck = now;
+
+  struct stat st;
+  if (stat(E.filename, &st) == -1) return 0;
+  if (st.st_size == E.disksize && st.st_mtim.tv_sec == E.mtime.tv_sec &&
+      st.st_mtim.tv_nsec == E.mtime.tv_nsec) {
+    return 0;
+  }
+
+  if (E.dirty) {
+    editorSetStatusMessage("WARNING: File changed on disk. Saving will overwrite it.");
+    // The file no longer holds the rows it was read from
+    E.save.synced = 0;
+    editorRecordFileState();
+  } else {
+    int exact;
+    int replaced = editorReloadFile(&exact);
+    if (replaced == -1) return 0;
+    editorSetStatusMessage("File changed on disk, %d lines reloaded", replaced);
+    editorRecordFileState();
+    editorMarkSynced(exact);
+  }
+  return 1;
+}
+
+/*** windows ***/
+
+/*
+Store the cursor and scroll position of the active window in its Window.
+*/
+void editorSaveWindow() {
+  Window *w = &E.win[E.curwin];
+  w->cx = E.cx;
+  w->cy = E.cy;
+  w->rx = E.rx;
+  w->rowoff = E.rowoff;
+  w->rowsub = E.rowsub;
+  w->coloff = E.coloff;
+}
+
+/*
+Make window i the active window, bringing its cursor and scroll position into
+the editor state.
+*/
+void editorLoadWindow(int i) {
+  Window *w = &E.win[i];
+  E.curwin = i;
+  E.cx = w->cx;
+  E.cy = w->cy;
+  E.rx = w->rx;
+  E.rowoff = w->rowoff;
+  E.rowsub = w->rowsub;
+  E.coloff = w->coloff;
+  E.screenRows = w->rows;
+  E.screenCols = w->cols;
+  // Rows may have been deleted through another window
+  editorClampCursor();
+  if (E.rowoff > E.numrows) E.rowoff = E.numrows;
+}
+
+/*
+Move the cursor and scroll position of every window but the active one along
+with the rows, after delcount rows at index at were replaced by inscount new
+ones. Rows after them move by the difference; positions inside the deleted
+rows go to where they were.
+*/
+void editorShiftWindows(int at, int delcount, int inscount) {
+  for (int i = 0; i < E.numwins; i++) {
+    if (i == E.curwin) continue;
+    Window *w = &E.win[i];
+    if (w->cy >= at + delcount) {
+      w->cy += inscount - delcount;
+    } else if (w->cy > at) {
+      w->cy = at;
+      w->cx = 0;
+    }
+    if (w->rowoff >= at + delcount) {
+      w->rowoff += inscount - delcount;
+    } else if (w->rowoff > at) {
+      w->rowoff = at;
+      w->rowsub = 0;
+    }
+  }
+}
+
+/*
+Forget what a window last drew, so that all of it is sent again.
+*/
+void editorForgetDrawn(Window *w) {
+  if (w->drawn == NULL) return;
+  for (int y = 0; y < w->rows; y++) {
+    abFree(&w->drawn[y]);
+  }
+  free(w->drawn);
+  w->drawn = NULL;
+}
+
+/*
+Mark every window to be drawn again from scratch.
+*/
+void editorRedrawAll() {
+  for (int i = 0; i < E.numwins; i++) {
+    editorForgetDrawn(&E.win[i]);
+    E.win[i].redraw = 1;
+  }
+}
+
+/*
+Split the active window in two, one above the other if vertical is 0 or side
+by side otherwise. Both halves start at the same position and the new one
+becomes active.
+*/
+void editorSplitWindow(int vertical) {
+  editorSaveWindow();
+  Window *w = &E.win[E.curwin];
+  // Leave room for the separator and at least one row or column on each side
+  if ((vertical && w->cols < 3) || (!vertical && w->rows < 3)) {
+    editorSetStatusMessage("Window is too small to split");
+    return;
+  }
+
+  E.win = realloc(E.win, sizeof(Window) * (E.numwins + 1));
+  w = &E.win[E.curwin];
+  Window *new = &E.win[E.numwins];
+  *new = *w;
+  new->drawn = NULL;
+  if (vertical) {
+    w->cols = (w->cols - 1) / 2;
+    new->left = w->left + w->cols + 1;
+    new->cols -= w->cols + 1;
+  } else {
+    w->rows = (w->rows - 1) / 2;
+    new->top = w->top + w->rows + 1;
+    new->rows -= w->rows + 1;
+  }
+  E.numwins++;
+  E.block = 0;
+  editorLoadWindow(E.numwins - 1);
+  editorRedrawAll();
+}
+
+/*
+Close the active window and give its space to a neighbour of the same height
+or width. Windows are only split in two, so the last window split off can
+always be closed.
+*/
+void editorCloseWindow() {
+  if (E.numwins == 1) return;
+  Window *w = &E.win[E.curwin];
+  int j;
+  for (j = 0; j < E.numwins; j++) {
+    Window *o = &E.win[j];
+    if (j == E.curwin) continue;
+    if (o->top == w->top && o->rows == w->rows) {
+      // Neighbour to the left or right
+      if (o->left + o->cols + 1 == w->left) {
+        o->cols += w->cols + 1;
+        break;
+      }
+      if (w->left + w->cols + 1 == o->left) {
+        o->left = w->left;
+        o->cols += w->cols + 1;
+        break;
+      }
+    }
+    if (o->left == w->left && o->cols == w->cols) {
+      // Neighbour above or below
+      if (o->top + o->rows + 1 == w->top) {
+        o->rows += w->rows + 1;
+        break;
+      }
+      if (w->top + w->rows + 1 == o->top) {
+        o->top = w->top;
+        o->rows += w->rows + 1;
+        break;
+      }
+    }
+  }
+  if (j == E.numwins) {
+    editorSetStatusMessage("Can't close this window");
+    return;
+  }
+
+  editorForgetDrawn(w);
+  memmove(&E.win[E.curwin], &E.win[E.curwin + 1], sizeof(Window) * (E.numwins - E.curwin - 1));
+  E.numwins--;
+  if (j > E.curwin) j--;
+  E.block = 0;
+  editorLoadWindow(j);
+  editorRedrawAll();
+}
+
+/*
+Make the next window active.
+*/
+void editorNextWindow() {
+  editorSaveWindow();
+  editorEndBlock();
+  editorLoadWindow((E.curwin + 1) % E.numwins);
+}
+
+/*
+Handle a window command, given as the key pressed after CTRL-W.
+*/
+void editorWindowCommand(int c) {
+  switch (c) {
+    case 's': editorSplitWindow(0); break;
+    case 'v': editorSplitWindow(1); break;
+    case 'w':
+    case CTRL_KEY('w'):
+      editorNextWindow();
+      break;
+    case 'c': editorCloseWindow(); break;
+  }
+}
+
+/*** wrap ***/
+
+/*
+Returns the render index where the screen line of a row that starts at start
+ends, when the row is wrapped at width columns. Lines are broken after the
+last space that fits, or at the width if there is none.
+*/
+int editorWrapNext(Erow *row, int start, int width) {
+  if (row->rsize - start <= width) return row->rsize;
+  char *render = editorRowRender(row);
+  for (int i = start + width; i > start; i--) {
+    if (render[i - 1] == ' ') return i;
+  }
+  return start + width;
+}
+
+/*
+Returns the number of screen lines a row takes when wrapped at width columns.
+*/
+int editorWrapCount(Erow *row, int width) {
+  int count = 1;
+  for (int start = 0; (start = editorWrapNext(row, start, width)) < row->rsize; ) {
+    count++;
+  }
+  return count;
+}
+
+/*
+Returns which screen line of a row holds render column rx, and sets start to
+where that line starts.
+*/
+int editorWrapLine(Erow *row, int rx, int width, int *start) {
+  int line = 0;
+  *start = 0;
+  while (1) {
+    int next = editorWrapNext(row, *start, width);
+    if (rx < next || next >= row->rsize) return line;
+    *start = next;
+    line++;
+  }
+}
+
+/*
+Work out the screen lines of the row at index idx again, after it changed.
+*/
+void editorWrapUpdate(int idx) {
+  for (int k = 0; k < E.wrap.numlayouts; k++) {
+    WrapLines *l = &E.wrap.layouts[k];
+    long long lines[WRAP_COLUMNS] = {editorWrapCount(&E.row[idx], l->width), 0};
+    fenwickSet(&l->lines, idx, lines);
+  }
+}
+
+/*
+Drop every layout.
+*/
+void editorWrapFree() {
+  for (int k = 0; k < E.wrap.numlayouts; k++) {
+    fenwickFree(&E.wrap.layouts[k].lines);
+  }
+  free(E.wrap.layouts);
+  E.wrap.layouts = NULL;
+  E.wrap.numlayouts = 0;
+  E.wrap.cur = -1;
+}
+
+/*
+Use the layout for a given width, keeping the layouts for the widths of the
+other windows. A width that has none yet gets one where each row is only
+estimated from its length, in O(1); the rows that are shown are worked out
+exactly as they are needed, and the rest while the editor waits for keys.
+*/
+void editorWrapLayout(int width) {
+  int k;
+  for (k = 0; k < E.wrap.numlayouts; k++) {
+    if (E.wrap.layouts[k].width == width) {
+      E.wrap.cur = k;
+      return;
+    }
+  }
+
+  // Layouts for widths that no window has any more are dropped
+  for (k = 0; k < E.wrap.numlayouts; ) {
+    int used = 0;
+    for (int j = 0; j < E.numwins; j++) {
+      if (E.win[j].cols == E.wrap.layouts[k].width) used = 1;
+    }
+    if (used) {
+      k++;
+      continue;
+    }
+    fenwickFree(&E.wrap.layouts[k].lines);
+    E.wrap.layouts[k] = E.wrap.layouts[--E.wrap.numlayouts];
+  }
+
+  E.wrap.layouts = realloc(E.wrap.layouts, sizeof(WrapLines) * (E.wrap.numlayouts + 1));
+  WrapLines *l = &E.wrap.layouts[E.wrap.numlayouts];
+  l->width = width;
+  fenwickInit(&l->lines, WRAP_COLUMNS);
+  fenwickInsert(&l->lines, 0, E.numrows);
+  for (int i = 0; i < E.numrows; i++) {
+    int rsize = E.row[i].rsize;
+    // Rows that fit need no estimate
+    long long lines[WRAP_COLUMNS] = {1, 0};
+    if (rsize > width) {
+      lines[WRAP_LINES] = (rsize + width - 1) / width;
+      lines[WRAP_ESTIMATED] = 1;
+    }
+    fenwickSet(&l->lines, i, lines);
+  }
+  E.wrap.cur = E.wrap.numlayouts++;
+}
+
+/*
+Make sure rows lo to hi are laid out exactly.
+*/
+void editorWrapEnsure(int lo, int hi) {
+  if (lo < 0) lo = 0;
+  if (hi >= E.numrows) hi = E.numrows - 1;
+  if (lo > hi) return;
+  editorEnsureRows(lo, hi);
+  Fenwick *lines = &E.wrap.layouts[E.wrap.cur].lines;
+  for (int i = lo; i <= hi; i++) {
+    if (fenwickGet(lines, i, WRAP_ESTIMATED)) editorWrapUpdate(i);
+  }
+}
+
+/*
+Lay out estimated rows exactly for a short while, those of the active window
+first. Returns 1 if there are more left.
+*/
+int editorWrapSome() {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int k = 0; k < E.wrap.numlayouts; k++) {
+    Fenwick *lines = &E.wrap.layouts[(E.wrap.cur + k) % E.wrap.numlayouts].lines;
+    while (fenwickPrefix(lines, E.numrows, WRAP_ESTIMATED) > 0) {
+      // The first estimated row is the first one after a run of zeros
+      for (int i = fenwickSearch(lines, WRAP_ESTIMATED, 0), n = 0; i < E.numrows && n < 64; i++, n++) {
+        if (fenwickGet(lines, i, WRAP_ESTIMATED)) editorWrapUpdate(i);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+      if (ms >= NUCLEUS_LOAD_SLICE_MS) return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+Returns the screen line of the whole buffer that the cursor is on, and sets
+start to the render column where that line starts.
+*/
+long long editorWrapCursorLine(int *start) {
+  WrapLines *l = &E.wrap.layouts[E.wrap.cur];
+  *start = 0;
+  long long line = fenwickPrefix(&l->lines, E.cy, WRAP_LINES);
+  if (E.cy < E.numrows) line += editorWrapLine(&E.row[E.cy], E.rx, l->width, start);
+  return line;
+}
+
+/*
+Scroll so the cursor is shown, in wrap mode. Positions are counted in screen
+lines, which the layout turns into rows and back in O(log n).
+*/
+void editorWrapScroll() {
+  editorWrapLayout(E.screenCols);
+  editorWrapEnsure(E.cy - E.screenRows, E.cy + E.screenRows);
+  editorWrapEnsure(E.rowoff, E.rowoff + E.screenRows);
+
+  Fenwick *lines = &E.wrap.layouts[E.wrap.cur].lines;
+  int start;
+  long long cursor = editorWrapCursorLine(&start);
+  long long top = fenwickPrefix(lines, E.rowoff, WRAP_LINES) + E.rowsub;
+  if (cursor < top) {
+    top = cursor;
+  }
+  if (cursor >= top + E.screenRows) {
+    top = cursor - E.screenRows + 1;
+  }
+  E.rowoff = fenwickSearch(lines, WRAP_LINES, top);
+  E.rowsub = top - fenwickPrefix(lines, E.rowoff, WRAP_LINES);
+  E.coloff = 0;
+}
+
+/*
+Find where the cursor is shown in the active window, in wrap mode.
+*/
+void editorWrapCursor(int *y, int *x) {
+  int start;
+  long long top = fenwickPrefix(&E.wrap.layouts[E.wrap.cur].lines, E.rowoff, WRAP_LINES) + E.rowsub;
+  *y = editorWrapCursorLine(&start) - top;
+  *x = E.rx - start;
+  if (*x >= E.screenCols) *x = E.screenCols - 1;
+}
+
+/*
+Move the cursor up or down by screen lines rather than rows, keeping its
+column on the screen. Paging moves by a window of screen lines.
+*/
+void editorWrapMoveCursor(int key) {
+  Fenwick *lines = &E.wrap.layouts[E.wrap.cur].lines;
+  int width = E.wrap.layouts[E.wrap.cur].width;
+  int start;
+  long long line = editorWrapCursorLine(&start);
+  long long total = fenwickPrefix(lines, E.numrows, WRAP_LINES);
+  int col = E.rx - start;
+  switch (key) {
+    case ARROW_UP: line--; break;
+    case ARROW_DOWN: line++; break;
+    case PAGE_UP: line -= E.screenRows; break;
+    case PAGE_DOWN: line += E.screenRows; break;
+  }
+  if (line < 0) line = 0;
+  if (line > total) line = total;
+
+  // Lay out the rows around where the cursor lands before landing on them
+  int row = fenwickSearch(lines, WRAP_LINES, line);
+  editorWrapEnsure(row - E.screenRows, row + E.screenRows);
+  row = fenwickSearch(lines, WRAP_LINES, line);
+  if (row >= E.numrows) {
+    E.cy = E.numrows;
+    E.cx = 0;
+    return;
+  }
+
+  Erow *r = &E.row[row];
+  int sub = line - fenwickPrefix(lines, row, WRAP_LINES);
+  start = 0;
+  while (sub-- > 0) start = editorWrapNext(r, start, width);
+  int end = editorWrapNext(r, start, width);
+  int rx = start + col;
+  // Stay on the screen line, rather than the start of the next one
+  if (end < r->rsize && rx >= end) rx = end - 1;
+  if (rx > r->rsize) rx = r->rsize;
+  E.cy = row;
+  E.cx = editorRowRxToCx(r, rx);
 }
 
 /*
-Save contents of editor to file
+Turn wrap mode on or off.
 */
-void editorSave() {
-  // Prompt for filename
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)");
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-  };
-
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  /* Open file so it is available to read and write. If there is not an existing
-     file one will be created. 0644 is the estandard permission code for text files.
-     This code allows owner to read and write and others to only read the file.
-  */
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  // If successfully opened file, then write to file
-  if (fd != -1) {
-    // Prevents owner from overwriting other data.
-    // ftruncate sets the file's size to specified length
-    if (ftruncate(fd, len) != -1) {
-      // Write to file, check that the correct number of bytes was written
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+void editorToggleWrap() {
+  if (E.hex.map) {
+    editorSetStatusMessage("Wrap mode is not available in hex view");
+    return;
   }
-  // Show error message
-  free(buf);
-  editorSetStatusMessage("Failed to save. I/O ERROR: %s", strerror(errno));
+  E.block = 0;
+  E.wrap.on = !E.wrap.on;
+  if (!E.wrap.on) editorWrapFree();
+  E.rowsub = 0;
+  for (int i = 0; i < E.numwins; i++) {
+    E.win[i].rowsub = 0;
+  }
+  editorRedrawAll();
+  editorSetStatusMessage("Wrap mode %s", E.wrap.on ? "on" : "off");
 }
 
 /*** input ***/
@@ -610,11 +3170,18 @@ char *editorPrompt(char *prompt) {
   }
 }
 void editorMoveCursor(int key) {
+  // The cursor can reach the rows next to it
+  editorEnsureRows(E.cy - 1, E.cy + 1);
   // Gets the current row that the cursor is on, or sets the current row to null
   Erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
   switch (key) {
     // Determine which was to more cursor depending on which key you press.
     case ARROW_LEFT:
+      // A block edge past the end of a short row moves back towards it
+      if (E.block && row && E.block_curx > row->rsize) {
+        E.block_curx--;
+        return;
+      }
       // Check if you are at the left edge of window
       if (row && E.cx != 0) {
         E.cx--;
@@ -646,17 +3213,147 @@ void editorMoveCursor(int key) {
   }
 
   row = (E.cy >= E.numrows) ? NULL : & E.row[E.cy];
+  // Moving up and down keeps the column of the block edge, however short
+  // the rows passed on the way are
+  if (E.block && row && (key == ARROW_UP || key == ARROW_DOWN)) {
+    E.cx = editorRowRxToCx(row, E.block_curx);
+  }
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  if (E.block && (key == ARROW_LEFT || key == ARROW_RIGHT)) editorBlockFollowCursor();
+}
+
+/*
+Ask where to go and move the cursor there. The answer is a line number, a
+byte offset prefixed with b, or a percentage of the file followed by %.
+The row holding a byte offset is found from the document statistics, so no
+rows are scanned.
+*/
+void editorGoto() {
+  // The prompt also tells how long the document is. Chunks that are not
+  // loaded yet only know their size in bytes, so the counts wait for them.
+  long long total = fenwickPrefix(&E.stats, E.numrows, STAT_BYTES);
+  char prompt[128];
+  if (E.load.map) {
+    snprintf(prompt, sizeof(prompt),
+      "Go to line, b<byte> or <percent>%%%% [still counting]: %%s (ESC to cancel)");
+  } else {
+    snprintf(prompt, sizeof(prompt),
+      "Go to line, b<byte> or <percent>%%%% [%lld words, %lld chars]: %%s (ESC to cancel)",
+      fenwickPrefix(&E.stats, E.numrows, STAT_WORDS), fenwickPrefix(&E.stats, E.numrows, STAT_CHARS));
+  }
+  char *answer = editorPrompt(prompt);
+  if (answer == NULL) return;
+
+  size_t len = strlen(answer);
+  long long target = -1;
+  if (answer[0] == 'b') {
+    target = atoll(&answer[1]);
+  } else if (len > 0 && answer[len - 1] == '%') {
+    target = total * atoi(answer) / 100;
+  } else {
+    int line = atoi(answer);
+    if (line > 0) {
+      E.cy = line > E.numrows ? E.numrows : line - 1;
+      E.cx = 0;
+    } else {
+      editorSetStatusMessage("Not a line number");
+    }
+  }
+  free(answer);
+  if (target < 0) return;
+
+  if (target >= total) {
+    E.cy = E.numrows;
+    E.cx = 0;
+    return;
+  }
+  E.cy = fenwickSearch(&E.stats, STAT_BYTES, target);
+  // An unloaded chunk only knows its total size; load it and look again
+  if (E.load.map) {
+    editorEnsureRows(E.cy, E.cy);
+    E.cy = fenwickSearch(&E.stats, STAT_BYTES, target);
+    editorEnsureRows(E.cy, E.cy);
+  }
+  E.cx = target - fenwickPrefix(&E.stats, E.cy, STAT_BYTES);
+  // An offset on a newline puts the cursor at the end of its row
+  if (E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
 }
+
 /*
 Waits for one key press and handles it.
 */
 void editorProcessKeypress() {
   static int quit_times = NUCLEUS_QUIT_TIMES;
   int c = editorReadKey();
+
+  // A file shown as hex has keys of its own
+  if (E.hex.map && editorHexProcessKey(c)) {
+    quit_times = NUCLEUS_QUIT_TIMES;
+    return;
+  }
+
+  // Moving around, windows and leaving only need the rows that are shown, but
+  // anything that edits rows needs the whole file to be loaded
+  if (E.load.map) {
+    switch (c) {
+      case ARROW_UP:
+      case ARROW_DOWN:
+      case ARROW_LEFT:
+      case ARROW_RIGHT:
+      case PAGE_UP:
+      case PAGE_DOWN:
+      case HOME_KEY:
+      case END_KEY:
+      case CTRL_KEY('g'):
+      case CTRL_KEY('q'):
+      case CTRL_KEY('w'):
+      case CTRL_KEY('l'):
+      case '\x1b':
+        break;
+      case CTRL_KEY('s'):
+        // A buffer that is still loading has nothing to save until it is edited
+        if (!E.dirty) {
+          editorSetStatusMessage("No changes to save");
+          return;
+        }
+        editorLoadAll();
+        break;
+      default:
+        editorLoadAll();
+        break;
+    }
+  }
+
+  // While a block is selected, edits are applied at every cursor in it
+  if (E.block) {
+    switch (c) {
+      case CTRL_KEY('b'):
+      case '\x1b':
+        editorEndBlock();
+        return;
+
+      case BACKSPACE:
+      case CTRL_KEY('h'):
+      case DELETE_KEY:
+        editorBlockDelChar(c);
+        return;
+
+      case '\r':
+        editorEndBlock();
+        break;
+
+      default:
+        if ((!iscntrl(c) && c < 128) || c == '\t') {
+          editorBlockInsertChar(c);
+          return;
+        }
+        break;
+    }
+  }
+
   switch (c) {
     case '\r':
       editorInsertNewLine();
@@ -664,13 +3361,21 @@ void editorProcessKeypress() {
 
     // Check for confirmation by asking user to press CTRL+Q 3 times
     case CTRL_KEY('q'):
+      // A client of the daemon detaches instead, leaving the buffer loaded
+      if (T.remote) {
+        write(T.out, "\x1b[2J", 4);
+        write(T.out, "\x1b[H", 3);
+        T.detached = 1;
+        return;
+      }
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING: File has unsaved changes. Press CTRL-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      write(T.out, "\x1b[2J", 4);
+      write(T.out, "\x1b[H", 3);
+      editorFreeRows();
       exit(0);
       break;
 
@@ -678,14 +3383,69 @@ void editorProcessKeypress() {
       editorSave();
       break;
 
+    case CTRL_KEY('b'):
+      editorToggleBlock();
+      break;
+
+    case CTRL_KEY('r'):
+      {
+        char *filename = editorPrompt("Insert file: %s (ESC to cancel)");
+        if (filename) {
+          editorInsertFile(filename);
+          free(filename);
+        }
+      }
+      break;
+
+    case CTRL_KEY('k'):
+      {
+        int count = editorPromptCount("Delete lines: %s (ESC to cancel)");
+        if (count) editorKillRows(count);
+      }
+      break;
+
+    case CTRL_KEY('y'):
+      {
+        int count = editorPromptCount("Yank lines: %s (ESC to cancel)");
+        if (count) {
+          editorSetStatusMessage("%d lines yanked", editorYankRows(count));
+        }
+      }
+      break;
+
+    case CTRL_KEY('p'):
+      editorPutRows();
+      break;
+
+    case CTRL_KEY('g'):
+      editorGoto();
+      if (E.block) editorBlockFollowCursor();
+      break;
+
+    case CTRL_KEY('t'):
+      editorToggleWrap();
+      break;
+
+    case CTRL_KEY('w'):
+      editorSetStatusMessage("Window: s = split | v = vertical split | w = next | c = close");
+      editorRefreshScreen();
+      {
+        int cmd = editorReadKey();
+        editorSetStatusMessage("");
+        editorWindowCommand(cmd);
+      }
+      break;
+
     case HOME_KEY:
       E.cx = 0;
+      if (E.block) editorBlockFollowCursor();
       break;
 
     case END_KEY:
       if (E.cy < E.numrows) {
         E.cx = E.row[E.cy].size;
       }
+      if (E.block) editorBlockFollowCursor();
       break;
 
     case BACKSPACE:
@@ -699,6 +3459,10 @@ void editorProcessKeypress() {
 
     case PAGE_UP:
     case PAGE_DOWN:
+      if (E.wrap.on) {
+        editorWrapMoveCursor(c);
+        break;
+      }
       {
         if (c == PAGE_UP) {
           E.cy = E.rowoff;
@@ -720,6 +3484,12 @@ void editorProcessKeypress() {
     // Moves cursor around depending on which arrow key you press
     case ARROW_UP:
     case ARROW_DOWN:
+      if (E.wrap.on) {
+        editorWrapMoveCursor(c);
+        break;
+      }
+      editorMoveCursor(c);
+      break;
     case ARROW_LEFT:
     case ARROW_RIGHT:
       editorMoveCursor(c);
@@ -739,12 +3509,20 @@ void editorProcessKeypress() {
 
 /*** output ***/
 void editorScroll() {
+  editorEnsureRows(E.cy, E.cy);
   // Determine the x position of the cursor, based off of the render position
   E.rx = 0;
-  if (E.cy < E.numrows) {
+  if (E.hex.map) {
+    E.rx = editorHexRx();
+  } else if (E.cy < E.numrows) {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
+  if (E.wrap.on) {
+    editorWrapScroll();
+    return;
+  }
+
   // If the cursor is above visible window, then scroll up to where cursor is
   if (E.cy < E.rowoff) {
     E.rowoff = E.cy;
@@ -762,54 +3540,226 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(Abuf *ab) {
-  for (int y = 0; y < E.screenRows; y++) {
-    // Get the row of the file that you want to display at each y position
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows){
-      // Display welcome message for users
-      if (E.numrows == 0 && y == E.screenRows/3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-            "Nucleus Editor -- version %s", NUCLEUS_VERSION);
-        if (welcomelen > E.screenCols) {
-          welcomelen = E.screenCols;
-        }
-        // Center welcome message
-        // Find the center of the screen
-        int padding = (E.screenCols - welcomelen)/2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          // Deleting padding
-          padding--;
-        }
-        while (padding--) {
-          abAppend(ab, " ", 1);
-        }
-        abAppend(ab, welcome, welcomelen);
-      } else {
-        // Draw a column of tildes on the lefthand side of the screen
+/*
+Move the terminal cursor to a given (0-based) screen row and column.
+*/
+void abMoveTo(Abuf *ab, int y, int x) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+/*
+Fill the rest of a line in a window that has drawn len columns so far.
+*/
+void editorClearLine(Abuf *ab, Window *w, int len) {
+  // A window reaching the right edge can clear to the end of the line
+  if (w->left + w->cols == E.termCols) {
+    abAppend(ab, "\x1b[K", 3);
+    return;
+  }
+  while (len++ < w->cols) {
+    abAppend(ab, " ", 1);
+  }
+}
+
+/*
+Draw one line of a window, along with the separator to its right.
+*/
+void editorDrawWindowLine(Abuf *ab, Window *w, int y, int active) {
+  int drawn = 0;
+  // Get the row of the file that you want to display at each y position
+  int filerow = y + w->rowoff;
+  if (filerow >= E.numrows){
+    // Display welcome message for users
+    if (E.numrows == 0 && y == w->rows/3) {
+      char welcome[80];
+      int welcomelen = snprintf(welcome, sizeof(welcome),
+          "Nucleus Editor -- version %s", NUCLEUS_VERSION);
+      if (welcomelen > w->cols) {
+        welcomelen = w->cols;
+      }
+      // Center welcome message
+      // Find the center of the screen
+      int padding = (w->cols - welcomelen)/2;
+      drawn = padding + welcomelen;
+      if (padding) {
         abAppend(ab, "~", 1);
+        // Deleting padding
+        padding--;
+      }
+      while (padding--) {
+        abAppend(ab, " ", 1);
       }
+      abAppend(ab, welcome, welcomelen);
     } else {
-      // Determine where to draw, accounting for column offset
-      int len = E.row[filerow].rsize - E.coloff;
-      // User scrolled past the end of the line
-      if (len < 0) {
-        len = 0;
+      // Draw a column of tildes on the lefthand side of the screen
+      abAppend(ab, "~", 1);
+      drawn = 1;
+    }
+  } else if (E.hex.map) {
+    // Hex view formats just the rows that are shown
+    char line[96];
+    int len = editorHexRenderRow(filerow, line) - w->coloff;
+    if (len > w->cols) {
+      len = w->cols;
+    }
+    if (len > 0) {
+      abAppend(ab, &line[w->coloff], len);
+      drawn = len;
+    }
+  } else {
+    // Determine where to draw, accounting for column offset
+    int len = E.row[filerow].rsize - w->coloff;
+    // User scrolled past the end of the line
+    if (len < 0) {
+      len = 0;
+    }
+    if (len > w->cols) {
+      len = w->cols;
+    }
+    drawn = len;
+    char *render = editorRowRender(&E.row[filerow]);
+    int top, bottom, left, right;
+    if (active && E.block && editorBlockBounds(&top, &bottom, &left, &right) &&
+        filerow >= top && filerow <= bottom) {
+      // Invert the selected columns, or a single column for each cursor
+      if (right == left) right++;
+      left -= w->coloff;
+      right -= w->coloff;
+      if (left < 0) left = 0;
+      if (right > w->cols) right = w->cols;
+      abAppend(ab, &render[w->coloff], left < len ? left : len);
+      // Columns past the end of the row are shown as spaces
+      for (int x = len; x < left; x++) abAppend(ab, " ", 1);
+      abAppend(ab, "\x1b[7m", 4);
+      for (int x = left; x < right; x++) {
+        abAppend(ab, x < len ? &render[w->coloff + x] : " ", 1);
       }
-      if (len > E.screenCols) {
-        len = E.screenCols;
+      abAppend(ab, "\x1b[m", 3);
+      if (len > right) abAppend(ab, &render[w->coloff + right], len - right);
+      if (right > drawn) drawn = right;
+    } else {
+      abAppend(ab, &render[w->coloff], len);
+    }
+  }
+
+  // Clears lines one at a time
+  editorClearLine(ab, w, drawn);
+  if (w->left + w->cols < E.termCols) abAppend(ab, "|", 1);
+}
+
+/*
+Send a line of a window to the terminal, unless the terminal already shows
+exactly that line.
+*/
+void editorSendLine(Abuf *ab, Window *w, int y, Abuf *line) {
+  if (w->drawn == NULL) {
+    w->drawn = calloc(w->rows, sizeof(Abuf));
+  }
+  Abuf *old = &w->drawn[y];
+  if (old->b && old->len == line->len && memcmp(old->b, line->b, line->len) == 0) {
+    abFree(line);
+    return;
+  }
+  abMoveTo(ab, w->top + y, w->left);
+  abAppend(ab, line->b, line->len);
+  abFree(old);
+  *old = *line;
+}
+
+/*
+Draw the lines of a window in wrap mode, where rows take as many lines as
+they need at the width of the window.
+*/
+void editorDrawWrappedWindow(Abuf *ab, Window *w) {
+  int filerow = w->rowoff;
+  int start = 0;
+  // Skip the lines of the top row that are scrolled off
+  if (filerow < E.numrows) {
+    Erow *row = &E.row[filerow];
+    for (int sub = 0; sub < w->rowsub; sub++) {
+      int next = editorWrapNext(row, start, w->cols);
+      if (next >= row->rsize) break;
+      start = next;
+    }
+  }
+
+  for (int y = 0; y < w->rows; y++) {
+    Abuf line = ABUF_INIT;
+    int drawn = 1;
+    if (filerow >= E.numrows) {
+      abAppend(&line, "~", 1);
+    } else {
+      Erow *row = &E.row[filerow];
+      int end = editorWrapNext(row, start, w->cols);
+      drawn = end - start;
+      abAppend(&line, &editorRowRender(row)[start], drawn);
+      if (end >= row->rsize) {
+        filerow++;
+        start = 0;
+      } else {
+        start = end;
       }
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
     }
+    editorClearLine(&line, w, drawn);
+    if (w->left + w->cols < E.termCols) abAppend(&line, "|", 1);
+    editorSendLine(ab, w, y, &line);
+  }
+}
+
+/*
+Draw the visible rows of a window, along with the separators to its right
+and below it. Only lines that differ from what the terminal shows are sent.
+*/
+void editorDrawWindow(Abuf *ab, Window *w, int active) {
+  int hassep = w->left + w->cols < E.termCols;
+  if (w->redraw) editorForgetDrawn(w);
+  if (E.wrap.on) {
+    editorDrawWrappedWindow(ab, w);
+  } else {
+    for (int y = 0; y < w->rows; y++) {
+      Abuf line = ABUF_INIT;
+      editorDrawWindowLine(&line, w, y, active);
+      editorSendLine(ab, w, y, &line);
+    }
+  }
 
+  // Draw the separator between this window and the one below it. It only
+  // changes when windows are split or closed.
+  if (w->redraw && w->top + w->rows < E.termRows) {
+    abMoveTo(ab, w->top + w->rows, w->left);
+    for (int x = 0; x < w->cols; x++) {
+      abAppend(ab, "-", 1);
+    }
+    if (hassep) abAppend(ab, "+", 1);
+  }
 
-    // Clears lines one at a time
-    abAppend(ab, "\x1b[K", 3);
+  w->drawn_rowoff = w->rowoff;
+  w->drawn_rowsub = w->rowsub;
+  w->drawn_coloff = w->coloff;
+  w->redraw = 0;
+}
 
-    abAppend(ab, "\r\n", 2);
+/*
+Draw the windows that changed since the last time the screen was drawn: those
+that were scrolled, and those showing rows that were edited.
+*/
+void editorDrawWindows(Abuf *ab) {
+  editorSaveWindow();
+  for (int i = 0; i < E.numwins; i++) {
+    Window *w = &E.win[i];
+    int active = i == E.curwin;
+    editorEnsureRows(w->rowoff, w->rowoff + w->rows - 1);
+    if (w->redraw || w->rowoff != w->drawn_rowoff || w->rowsub != w->drawn_rowsub ||
+        w->coloff != w->drawn_coloff ||
+        (E.damage_lo < w->rowoff + w->rows && E.damage_hi >= w->rowoff) ||
+        (active && E.block)) {
+      editorDrawWindow(ab, w, active);
+    }
   }
+  E.damage_lo = INT_MAX;
+  E.damage_hi = -1;
 }
 
 void editorDrawStatusBar(Abuf *ab) {
@@ -821,21 +3771,42 @@ void editorDrawStatusBar(Abuf *ab) {
   // Write status message, with the current filename (or [No Name] if no filename),
   // as well as current line number & whether the file has been modified
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "MODIFIED": " ");
-  // Determine render length
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-    E.cy + 1, E.numrows);
+  char loading[32] = "";
+  if (E.load.map) {
+    snprintf(loading, sizeof(loading), " (loading %d%%)",
+      E.load.numloaded * 100 / E.load.numchunks);
+  }
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s%s%s%s",
+    E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "MODIFIED": " ",
+    E.block ? " -- BLOCK --" : "", E.hex.map ? " -- HEX --" : "",
+    E.wrap.on ? " -- WRAP --" : "", loading);
+  // Determine render length, showing which window is active if there are several
+  char wstatus[32] = "";
+  if (E.numwins > 1) {
+    snprintf(wstatus, sizeof(wstatus), "[%d/%d] ", E.curwin + 1, E.numwins);
+  }
+  // Show the byte offset of the cursor and how far into the file it is
+  long long total, offset;
+  if (E.hex.map) {
+    total = E.hex.size;
+    offset = (long long)E.cy * NUCLEUS_HEX_WIDTH + E.cx;
+  } else {
+    total = fenwickPrefix(&E.stats, E.numrows, STAT_BYTES);
+    offset = fenwickPrefix(&E.stats, E.cy, STAT_BYTES) + E.cx;
+  }
+  if (offset > total) offset = total;
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%sbyte %lld %lld%% | %d/%d",
+    wstatus, offset, total ? offset * 100 / total : 100, E.cy + 1, E.numrows);
   // Cut status string short if it doesn't fit inside window
-  if (len > E.screenCols) {
-    len = E.screenCols;
+  if (len > E.termCols) {
+    len = E.termCols;
   }
   // Add status message to buffer
   abAppend(ab, status, len);
 
   // Draw message
-  while (len < E.screenCols) {
-    if (E.screenCols - len == rlen) {
+  while (len < E.termCols) {
+    if (E.termCols - len == rlen) {
       abAppend(ab, rstatus, rlen);
       break;
     } else {
@@ -846,7 +3817,6 @@ void editorDrawStatusBar(Abuf *ab) {
 
   // Resets colors
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
 /*
@@ -857,8 +3827,8 @@ void editorDrawMessageBar(Abuf *ab) {
   abAppend(ab,"\x1b[K", 3);
   // Check if status message is too long
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screenCols) {
-    msglen = E.screenCols;
+  if (msglen > E.termCols) {
+    msglen = E.termCols;
   }
   // Add message to buffer if it is <5s old
   if (msglen && time(NULL) - E.statusmsg_time < 5) {
@@ -866,23 +3836,46 @@ void editorDrawMessageBar(Abuf *ab) {
   }
 }
 
+/*
+Send a bar to a given screen row, unless the terminal already shows it.
+*/
+void editorSendBar(Abuf *ab, int y, Abuf *drawn, Abuf *bar) {
+  if (drawn->b && drawn->len == bar->len && memcmp(drawn->b, bar->b, bar->len) == 0) {
+    abFree(bar);
+  } else {
+    abMoveTo(ab, y, 0);
+    abAppend(ab, bar->b, bar->len);
+    abFree(drawn);
+    *drawn = *bar;
+  }
+  bar->b = NULL;
+  bar->len = 0;
+}
+
 void editorRefreshScreen() {
   editorScroll();
   // do not think "\x1b[?25 is supported in our termial, so leaving it commented out"
   Abuf ab = ABUF_INIT;
   // abAppend(&ab, "\1xb[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  // Only windows that changed are drawn, and the bars only when they changed
+  editorDrawWindows(&ab);
+  Abuf bar = ABUF_INIT;
+  editorDrawStatusBar(&bar);
+  editorSendBar(&ab, E.termRows, &T.status, &bar);
+  editorDrawMessageBar(&bar);
+  editorSendBar(&ab, E.termRows + 1, &T.message, &bar);
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy-E.rowoff) +1, (E.rx - E.coloff) + 1 );
-  abAppend(&ab, buf, strlen(buf));
+  Window *w = &E.win[E.curwin];
+  int y = E.cy - E.rowoff, x = E.rx - E.coloff;
+  if (E.wrap.on) editorWrapCursor(&y, &x);
+  abMoveTo(&ab, w->top + y, w->left + x);
   // abAppend(&ab, "\1xb[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  if (write(T.out, ab.b, ab.len) == -1 && T.remote) {
+    // The client has gone away
+    T.detached = 1;
+  }
   abFree(&ab);
 }
 
@@ -901,12 +3894,16 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /*** init ***/
 
-void initEditor() {
+/*
+Set up an empty buffer, without touching the terminal.
+*/
+void initBuffer() {
   // Set original placement of the cursor
   E.cx = 0;
   E.cy = 0;
   E.rx = 0;
   E.numrows = 0;
+  E.rowcap = 0;
   E.row = NULL;
   E.rowoff = 0;
   E.coloff = 0;
@@ -914,26 +3911,280 @@ void initEditor() {
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.dirty = 0;
+  memset(&E.pool, 0, sizeof(SlabPool));
+  E.block = 0;
+  E.yank = NULL;
+  E.yanklens = NULL;
+  E.numyank = 0;
+  E.disksize = -1;
+  E.lastcheck = 0;
+  E.win = NULL;
+  E.numwins = 0;
+  E.curwin = 0;
+  E.damage_lo = INT_MAX;
+  E.damage_hi = -1;
+  memset(&E.load, 0, sizeof(FileLoad));
+  fenwickInit(&E.stats, STAT_COLUMNS);
+  E.gen = 0;
+  memset(&E.save, 0, sizeof(SaveState));
+  memset(&E.hex, 0, sizeof(HexView));
+  memset(&E.wrap, 0, sizeof(WrapLayout));
+  E.wrap.cur = -1;
+  E.rowsub = 0;
+}
+
+/*
+Lay the buffer out on a screen of a given size, as a single window that
+keeps the cursor and scroll position of the active window.
+*/
+void editorSetScreenSize(int rows, int cols) {
+  E.termRows = rows - 2;
+  E.termCols = cols;
+
+  Window w;
+  memset(&w, 0, sizeof(Window));
+  if (E.win) {
+    editorSaveWindow();
+    w = E.win[E.curwin];
+    for (int i = 0; i < E.numwins; i++) {
+      editorForgetDrawn(&E.win[i]);
+    }
+    free(E.win);
+  }
+  w.top = 0;
+  w.left = 0;
+  w.rows = E.termRows;
+  w.cols = E.termCols;
+  w.drawn = NULL;
+  w.redraw = 1;
+
+  E.win = malloc(sizeof(Window));
+  E.win[0] = w;
+  E.numwins = 1;
+  E.block = 0;
+  editorLoadWindow(0);
+}
 
-  if (getWindowSize(&E.screenRows, &E.screenCols) == -1) {
+void initEditor() {
+  initBuffer();
+
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) {
     die("getWindowSize");
   }
-  E.screenRows -= 2;
+  editorSetScreenSize(rows, cols);
+}
+
+/*** daemon ***/
+
+/*
+Read a line from a file descriptor, without the newline. Returns -1 if the
+connection closed or the line does not fit in size bytes.
+*/
+int readLine(int fd, char *buf, size_t size) {
+  size_t len = 0;
+  while (len < size - 1) {
+    if (read(fd, &buf[len], 1) != 1) return -1;
+    if (buf[len] == '\n') {
+      buf[len] = '\0';
+      return len;
+    }
+    len++;
+  }
+  return -1;
+}
+
+/*
+Attach a client that has just connected to the buffer for the file it asks
+for, loading the file only if no earlier client has. The client sends its
+screen size and the absolute path of the file, each on its own line, and then
+keystrokes; it is sent the changed parts of the screen. Buffers stay loaded
+after the client detaches.
+*/
+void daemonServe(int fd, Editor **bufs, int *numbufs) {
+  char size[32], filename[PATH_MAX];
+  int rows, cols;
+  if (readLine(fd, size, sizeof(size)) == -1 ||
+      sscanf(size, "%d %d", &rows, &cols) != 2 || rows < 3 || cols < 1 ||
+      readLine(fd, filename, sizeof(filename)) == -1) {
+    return;
+  }
+
+  int i;
+  for (i = 0; i < *numbufs; i++) {
+    if ((*bufs)[i].filename && strcmp((*bufs)[i].filename, filename) == 0) break;
+  }
+  if (i < *numbufs) {
+    E = (*bufs)[i];
+    editorSetStatusMessage("Attached to loaded buffer | CTRL + Q = DETACH");
+  } else {
+    if (access(filename, R_OK) == -1) {
+      dprintf(fd, "Can't open %s: %s\r\n", filename, strerror(errno));
+      return;
+    }
+    initBuffer();
+    editorOpen(filename);
+    // A file the editor refuses to show leaves no name to find its buffer by
+    if (E.filename == NULL) {
+      dprintf(fd, "%s\r\n", E.statusmsg);
+      editorFreeRows();
+      free(E.stats.total);
+      return;
+    }
+    *bufs = realloc(*bufs, sizeof(Editor) * (*numbufs + 1));
+    (*numbufs)++;
+    // A message from opening the file takes the place of the help
+    if (E.statusmsg[0] == '\0') editorSetStatusMessage(NUCLEUS_HELP);
+  }
+
+  T.in = fd;
+  T.out = fd;
+  T.remote = 1;
+  T.detached = 0;
+  abFree(&T.status);
+  abFree(&T.message);
+  T.status = (Abuf)ABUF_INIT;
+  T.message = (Abuf)ABUF_INIT;
+  editorSetScreenSize(rows, cols);
+
+  while (!T.detached) {
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
+
+  // Keep the buffer, with its cursor position, for the next client
+  editorSaveWindow();
+  (*bufs)[i] = E;
+}
+
+/*
+Tell a client that connects while another is attached that the daemon is
+busy, and hang up on it.
+*/
+void daemonTurnAway() {
+  int fd = accept(T.listen, NULL, NULL);
+  if (fd == -1) return;
+  dprintf(fd, "The daemon is busy with another client, try again later\r\n");
+  close(fd);
+}
+
+/*
+Run the editor as a daemon listening on a Unix domain socket, serving one
+client at a time. Clients that connect while another is attached are told
+the daemon is busy.
+*/
+void daemonRun(char *path) {
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) die("socket");
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    die("socket");
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
+  if (listen(sock, 8) == -1) die("listen");
+  // A client that goes away while being drawn to must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+  T.listen = sock;
+
+  Editor *bufs = NULL;
+  int numbufs = 0;
+  while (1) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR) continue;
+      die("accept");
+    }
+    daemonServe(fd, &bufs, &numbufs);
+    close(fd);
+    T.in = STDIN_FILENO;
+    T.out = STDOUT_FILENO;
+    T.remote = 0;
+  }
+}
+
+/*
+Attach the terminal to a daemon listening on a given socket and edit a file
+there. Keystrokes are passed to the daemon as they are typed, and whatever
+it draws is passed to the terminal.
+*/
+void clientRun(char *path, char *filename) {
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) die("socket");
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("connect");
+
+  // The daemon runs in its own directory, so send it an absolute path
+  char abspath[PATH_MAX];
+  if (realpath(filename, abspath) == NULL) die("realpath");
+
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+  enableRawMode();
+  dprintf(sock, "%d %d\n%s\n", rows, cols, abspath);
+
+  char buf[65536];
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sock, POLLIN, 0}};
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if (fds[0].revents & POLLIN) {
+      int nread = read(STDIN_FILENO, buf, sizeof(buf));
+      if (nread > 0 && write(sock, buf, nread) != nread) break;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP)) {
+      int nread = read(sock, buf, sizeof(buf));
+      // The daemon closes the connection when the client detaches
+      if (nread <= 0) break;
+      write(STDOUT_FILENO, buf, nread);
+    }
+  }
+  close(sock);
 }
 
 int main(int argc, char *argv[]) {
+  if (argc >= 3 && strcmp(argv[1], "--daemon") == 0) {
+    daemonRun(argv[2]);
+    return 0;
+  }
+  if (argc >= 4 && strcmp(argv[1], "--attach") == 0) {
+    clientRun(argv[2], argv[3]);
+    return 0;
+  }
+
   /* Want to disable canonical mode and turn on raw mode so that we can process
   each keypress as it comes in */
   enableRawMode();
   initEditor();
 
-  // Open file, if there is one
-  if (argc >= 2) {
+  // Open file, if there is one, at the line given as +N. With --hex, it is
+  // shown as hex even if it does not look binary.
+  int hex = argc >= 3 && strcmp(argv[1], "--hex") == 0;
+  if (hex) {
+    argc--;
+    argv++;
+  }
+  if (argc >= 2 && !(hex && editorOpenHex(argv[1]))) {
     editorOpen(argv[1]);
   }
+  if (argc >= 3 && argv[2][0] == '+') {
+    E.cy = atoi(&argv[2][1]) - 1;
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    if (E.hex.map && E.cy == E.numrows) E.cy--;
+    if (E.cy < 0) E.cy = 0;
+  }
 
-  // Set initial status message
-  editorSetStatusMessage("HELP: CTRL + S = SAVE | CTRL + Q = QUIT");
+  // Set initial status message, unless opening the file left one
+  if (E.statusmsg[0] == '\0') editorSetStatusMessage(NUCLEUS_HELP);
 
   // Continuously refresh the screen and process key presses
   while (1) {